@@ -10,6 +10,15 @@
 #include "oryx_list.h"
 #include "oryx_ipc.h"
 #include "oryx_cvhash.h"
+#include "oryx_cvhash_ring.h"
+#include "oryx_cvhash_hash.h"
+#include "oryx_cvhash_epoch.h"
+#include "oryx_cvhash_diff.h"
+#include "oryx_cvhash_balance.h"
+#include "oryx_cvhash_migrate.h"
+
+#include <math.h>
+#include <pthread.h>
 
 #define THRESHOLD_L1(i) (i*0.08)
 #define THRESHOLD_L2(i) (i*0.15)
@@ -18,12 +27,19 @@
 /** Input times. */
 #define MAX_INJECT_DATA	10000000
 
+/** Keys looked up at once by the injection tests. */
+#define INJECT_BATCH	256
+
+/** Concurrent transfers per machine of the migration plans printed by the tests. */
+#define MIGRATE_PER_NODE	2
+
 /** Physical node number. */
 #define MAX_BACKEND_MACHINES	100
 
+#ifndef CHASH_LIBRARY
 /** Physical node definition. */
 struct node_t backend_node[MAX_BACKEND_MACHINES] = {
-		{"Default0", "127.0.0.1", -1, -1, 0, {NULL, NULL}, 0}
+		{"Default0", "127.0.0.1", -1, 0, -1, 0, {NULL, NULL}, {NULL, NULL}, 0, {{0}}, 0}
 };
 
 /** Record map changes from virtual node to physical node 
@@ -35,48 +51,7 @@ int changes = 0;
 struct chash_root * ch_template;
 struct chash_root * ch_add;
 struct chash_root * ch_del;
-
-
-#define TIME_DECLARE()\
-	clock_t __s, __e;
-
-#define TIME_START()\
-	__s = clock();
-
-#define TIME_FINAL()\
-	__e = clock();
-
-#define TIME_CALC()\
-	;//printf ("Time occured %f s, %lu, %lu\n", (double) ((__e  - __s)/(double)CLOCKS_PER_SEC), __s, __e);
-
-uint32_t md5_hash (char *instr, size_t s)
-{
-	int i;
-	long hash = 0;
-	unsigned char digest[16];
-	apr_md5_ctx_t context;
-
-	apr_md5_init(&context);
-	apr_md5_update (&context, instr, s);
-	apr_md5_final (digest, &context);
-
-	/* use successive 4-bytes from hash as numbers */
-	for (i = 0; i < 4; i++) {
-	    hash += ((long)(digest[i*4 + 3]&0xFF) << 24)
-	        | ((long)(digest[i*4 + 2]&0xFF) << 16)
-	        | ((long)(digest[i*4 + 1]&0xFF) <<  8)
-	        | ((long)(digest[i*4 + 0]&0xFF));
-	}
-
-	return hash;
-}
-
-/** Hash function. */
-uint32_t hash_algo (char *instr, size_t s)
-{
-	return md5_hash (instr, s);
-	//return oryx_fnv1_hash (instr, s);
-}
+#endif /* CHASH_LIBRARY */
 
 /** Random value generator. */
 static __oryx_always_inline__
@@ -90,6 +65,19 @@ uint32_t next_rand_ (uint32_t *p)
 	return seed;
 }
 
+/** Random ring key generator, covers the whole ring key space. */
+static __oryx_always_inline__
+ring_key_t next_rand_key_ (uint32_t *p)
+{
+#ifdef CHASH_RING64
+	uint64_t hi = next_rand_ (p);
+
+	return (hi << 32) | next_rand_ (p);
+#else
+	return next_rand_ (p);
+#endif
+}
+
 /** A random IPv4 address generator.*/
 void ipaddr_generate (char *ipv4)
 {
@@ -159,7 +147,11 @@ static __oryx_always_inline__
 int _vn_cmpi (const struct rb_node* pos, const void* ptr)
 {
     struct vnode_t* vn = rb_entry(pos, struct vnode_t, node);
-    return (int)(*(uint32_t *)ptr - VN_KEY_I(vn));
+    ring_key_t k = VN_KEY_I(vn), hv = *(ring_key_t *)ptr;
+
+    /* Do not return the difference, it overflows an int for 32 bit keys
+       and breaks the ascending order of vn_root. */
+    return (k > hv) - (k < hv);
 }
 
 /** Virtual node dump handler. */
@@ -172,7 +164,8 @@ void _vn_dump (struct vnode_t *vn, int __attribute__((__unused__)) flags)
 
 	struct node_t * n = vn->physical_node;
 		
-	printf ("-- \"%s(%d)\"@%s(%d vnodes)\n", vn->videsc, vn->index, n->ipaddr, n->replicas);
+	printf ("-- \"%s(%d)\"@%s(%d vnodes) %llu hits\n", vn->videsc, vn->index, n->ipaddr, n->replicas,
+		(unsigned long long)VN_HITS(vn));
 }
 
 /** Virtual node travel handler which used to travek all virtual node
@@ -221,10 +214,31 @@ void _vn_travel (struct chash_root *ch, void (*fn)(struct vnode_t *, int), int f
 	}
 }
 
+/** Erase and free all virtual nodes of $ch. */
+static __oryx_always_inline__
+void _vn_destroy (struct chash_root *ch)
+{
+	struct rb_node* rbn;
+	struct vnode_t* vn;
+
+	while (NULL != (rbn = rb_first (&ch->vn_root))) {
+		vn = rb_entry (rbn, struct vnode_t, node);
+		rb_erase (rbn, &ch->vn_root);
+		list_del (&vn->vnode);
+		((struct node_t *)vn->physical_node)->valid_vns --;
+		free (vn->videsc);
+		free (vn->hits);
+		free (vn);
+	}
+
+	ch->vn_max = NULL;
+	ch->vn_min = NULL;
+}
+
 /** Virtual node allocation handler which used to allocating a new virtual node
-	and returns its address. */
+	and returns its address. Hit counters are allocated if $hits is set. */
 static __oryx_always_inline__
-void *_vn_alloc(void *n, uint32_t key, int i, char *videsc)
+void *_vn_alloc(void *n, ring_key_t key, int i, char *videsc, int hits)
 {
 
 	struct vnode_t *vn;
@@ -235,11 +249,15 @@ void *_vn_alloc(void *n, uint32_t key, int i, char *videsc)
 		rb_init_node(&vn->node);
 		vn->physical_node = n;
 		vn->index = i;
-		vn->videsc = malloc (strlen (videsc));
+		vn->videsc = malloc (strlen (videsc) + 1);
+		vn->hits = NULL;
 		VN_KEY_I(vn) = key;
+
+		if (hits && NULL != (vn->hits = ring_alloc (sizeof (struct hits_t))))
+			hits_reset (vn->hits);
 		
 		if (likely (vn->videsc))
-			memcpy (vn->videsc, videsc, strlen (videsc));
+			memcpy (vn->videsc, videsc, strlen (videsc) + 1);
 	}
 
 	return vn;
@@ -254,7 +272,7 @@ struct vnode_t *_vn_default (struct chash_root *ch)
 	
 	VN_DEFAULT(ch, dvn);
 
-	printf ("***    default VN(%s, %u) used !!!\n", dvn->videsc, VN_KEY_I(dvn));
+	printf ("***    default VN(%s, %llu) used !!!\n", dvn->videsc, (unsigned long long)VN_KEY_I(dvn));
 	return dvn;
 }
 
@@ -308,12 +326,18 @@ int _vn_add (struct chash_root *ch, struct node_t *n, struct vnode_t *vn)
 	if(unlikely(!vn))
 	    return -1;
 
-	if (!rb_insert (&vn->node, &ch->vn_root, (void *)(uint32_t *)&VN_KEY_I(vn)))
-		n->valid_vns ++;
+	if (rb_insert (&vn->node, &ch->vn_root, (void *)&VN_KEY_I(vn)))
+		return -1;
+
+	n->valid_vns ++;
+	list_add_tail (&vn->vnode, &n->vnode_head);
 
 	 return 0;
 }
 
+/** Size of a virtual node name, an ipaddr, a separator and an index. */
+#define VN_IDESC_SIZE	(sizeof (((struct node_t *)0)->ipaddr) + 12)
+
 /** Default naming function for a virtual node. Actually, you can change it if needed.*/
 static __oryx_always_inline__
 void _vn_fmt (char *idesc_in, int i, char *v_idesc_out, size_t *lo)
@@ -321,6 +345,25 @@ void _vn_fmt (char *idesc_in, int i, char *v_idesc_out, size_t *lo)
 	*lo = sprintf (v_idesc_out, "%s_%d", idesc_in, i);
 }
 
+/** Hash the $i-th virtual node of $n to its ring position, and name it in $v_idesc.
+	Must be called with $i = 0, 1, 2 ... in order for a node, $v_idesc holds VN_IDESC_SIZE bytes.
+	In ketama mode, one MD5 digest of "<ipaddr>-<i/4>" yields the positions of
+	four virtual nodes, it is computed when (i % 4 == 0) and kept in $digest. */
+static __oryx_always_inline__
+ring_key_t _vn_hash (struct chash_root *ch, struct node_t *n, int i,
+			char *v_idesc, size_t *lo, unsigned char *digest)
+{
+	if (ch->hash_algo == HASH_ALGO_KETAMA) {
+		*lo = sprintf (v_idesc, "%s-%d", n->ipaddr, i / 4);
+		if ((i & 3) == 0)
+			ketama_digest (v_idesc, *lo, digest);
+		return KETAMA_KEY (ketama_point (digest, i & 3));
+	}
+
+	_vn_fmt (n->ipaddr, i, v_idesc, lo);
+	return ch->hash_func (v_idesc, *lo);
+}
+
 /** Clone a physical node. */
 static __oryx_always_inline__
 void * _n_clone (struct node_t *n)
@@ -334,9 +377,10 @@ void * _n_clone (struct node_t *n)
 		
 		shadow->flags = 0;
 		shadow->replicas = n->replicas;
+		shadow->weight = n->weight;
 		strcpy (shadow->ipaddr, n->ipaddr);
 		strcpy (shadow->idesc, n->idesc);
-		N_HITS(shadow) = 0;
+		N_HITS_RESET(shadow);
 		N_VALID_VNS(shadow) = 0;
 		INIT_LIST_HEAD(&shadow->node);
 	}
@@ -365,7 +409,7 @@ void * _n_new ()
 		random_string_generate (key, 32);
 		strcpy (shadow->idesc, key);
 
-		N_HITS(shadow) = 0;
+		N_HITS_RESET(shadow);
 		N_VALID_VNS(shadow) = 0;
 		INIT_LIST_HEAD(&shadow->node);
 	}
@@ -373,6 +417,17 @@ void * _n_new ()
 	return shadow;
 }
 
+/** Append a physical node to list, with no virtual node yet. Must hold nhlock. */
+static __oryx_always_inline__
+void _n_link (struct chash_root *ch, struct node_t *n)
+{
+	list_add_tail (&n->node, &ch->node_head);
+	INIT_LIST_HEAD (&n->vnode_head);
+	ch->total_ns ++;
+	N_HITS_RESET(n);
+	N_VALID_VNS(n) = 0;
+}
+
 /** Add a physical node to list after DBCC. */
 static __oryx_always_inline__
 int _n_add (struct chash_root *ch, struct node_t *n)
@@ -391,28 +446,62 @@ int _n_add (struct chash_root *ch, struct node_t *n)
 		}
 	}
 
-	list_add_tail (&n->node, &ch->node_head);
-	ch->total_ns ++;
-	N_HITS(n) = 0;
-	N_VALID_VNS(n) = 0;
+	_n_link (ch, n);
 	
 	oryx_thread_mutex_unlock (&ch->nhlock);
 	
 	return 0;
 }
 
+/** Find a physical node by its ipaddr. */
+static __oryx_always_inline__
+struct node_t *_n_find (struct chash_root *ch, const char *nodekey)
+{
+	struct node_t *n = NULL, *n1 = NULL, *p;
+
+	oryx_thread_mutex_lock (&ch->nhlock);
+
+	list_for_each_entry_safe(n1, p, &ch->node_head, node) {
+		if (!oryx_strcmp_native(n1->ipaddr, nodekey)) {
+			n = n1;
+			break;
+		}
+	}
+
+	oryx_thread_mutex_unlock (&ch->nhlock);
+
+	return n;
+}
+
 /** Delete a specified physical node from list. */
 static __oryx_always_inline__
 int _n_del (struct chash_root *ch, struct node_t *n)
 {
 
+	oryx_thread_mutex_lock (&ch->nhlock);
 	list_del (&n->node);
 	ch->total_ns --;
+	oryx_thread_mutex_unlock (&ch->nhlock);
 
 	return 0;
 }
 
-struct chash_root *chash_init ()
+/** Put back a physical node deleted by _n_del right after $prev, the list entry it
+	followed, so that compact indexes (and jump buckets) are kept, and reinstall its
+	virtual nodes. They hash to the same positions, so the ring is as before. */
+static void _n_undel (struct chash_root *ch, struct node_t *n, struct list_head *prev)
+{
+	oryx_thread_mutex_lock (&ch->nhlock);
+	list_add (&n->node, prev);
+	ch->total_ns ++;
+	oryx_thread_mutex_unlock (&ch->nhlock);
+
+	if (ch->engine->vn_grow)
+		ch->engine->vn_grow (ch, n, 0, n->replicas);
+}
+
+/** New a consistent hash root whose ring positions are hashed with $algo (HASH_ALGO_XXX). */
+struct chash_root *chash_init (int algo)
 {
 	struct chash_root *ch;
 
@@ -422,10 +511,22 @@ struct chash_root *chash_init ()
 		return NULL;
 	}
 
-	ch->hash_func = hash_algo;
+	memset (ch, 0, sizeof (struct chash_root));
+	ch->hash_algo = algo;
+	ch->hash_func = hash_algo_func (algo);
+	ch->weight_vns = NODE_DEFAULT_VNS;
+	ch->ring_replicas = NODE_REPLICAS_DEFAULT;
+	ch->engine = &chash_engine_ring;
 	rb_init (&ch->vn_root, _vn_cmpi);
 	INIT_LIST_HEAD (&ch->node_head);
 
+	/* An empty snapshot, so that readers never fall back to vn_root. */
+	if (unlikely (ring_publish (ch))) {
+		printf ("Can not alloc memory. \n");
+		free (ch);
+		return NULL;
+	}
+
 	return ch;
 }
 
@@ -445,128 +546,58 @@ int total_vns (struct chash_root *ch)
 	return vns;
 }
 
-/** Remove a specified physical node from list.
-	Erase all its virtual node and update gloable default virtual node. */
-struct node_t *node_remove (struct chash_root *ch, char *nodekey)
+/** Count of virtual nodes of a node of weight $weight. */
+static __oryx_always_inline__
+int _n_weight_vns (struct chash_root *ch, double weight)
 {
-	int i;
-	uint32_t hv;
-	size_t lo = 0;
-	char key[32] = {0};
-	struct node_t *n = NULL, *n1 = NULL, *p;
-	struct vnode_t *vn = NULL;
-
-	/* Find the physical node by $nodekey  */
-	oryx_thread_mutex_lock (&ch->nhlock);
-	
-	list_for_each_entry_safe(n1, p, &ch->node_head, node) {
-		if (!oryx_strcmp_native(n1->ipaddr, nodekey)){
-			oryx_thread_mutex_unlock (&ch->nhlock);
-			n = n1;
-			goto find;
-		}
-	}
-	
-	oryx_thread_mutex_unlock (&ch->nhlock);
-	return NULL;
-	
-find:
-
-	for (i = 0; i < n->replicas; i ++) {
-		
-		_vn_fmt (n->ipaddr, i, key, &lo);
-	
-		hv = ch->hash_func (key, strlen (key));
-		vn = _vn_find (ch, (void *)&hv);
-		if (!vn) continue;
-		{
-			n1 = vn->physical_node;
-			rb_erase (&vn->node, &ch->vn_root);
-			n1->valid_vns --;
-		}
-	}
-
-	_n_del (ch, n);
-
-	ch->vn_max = NULL;
-	ch->vn_min = NULL;
-	
-	oryx_thread_mutex_lock (&ch->nhlock);
-	
-	list_for_each_entry_safe(n1, p, &ch->node_head, node) {
-		
-		for (i = 0; i < n1->replicas; i ++) {
-			_vn_fmt (n1->ipaddr, i, key, &lo);
-			hv = ch->hash_func (key, strlen (key));
-			vn = _vn_find (ch, (void *)&hv);
-			if (!vn) continue;
-
-			/** Init the maximun and minmum (of key) node */
-			if (ch->vn_max == NULL)
-				ch->vn_max = &vn->node;
-			if (ch->vn_min == NULL)
-				ch->vn_min = &vn->node;
-			
-			/** Update the maximun (of key) node */
-			if (ch->vn_max != NULL) {
-				struct vnode_t *vn_max = rb_entry(ch->vn_max, struct vnode_t, node);
-				if (VN_KEY_I(vn_max) < VN_KEY_I(vn))
-					ch->vn_max = &vn->node;
-			}
-
-			/** Update the minimun (of key) node */
-			if (ch->vn_min != NULL) {
-				struct vnode_t *vn_min = rb_entry(ch->vn_min, struct vnode_t, node);
-				if (VN_KEY_I(vn_min) > VN_KEY_I(vn))
-					ch->vn_min = &vn->node;
-			}
-		
-		}
-	}
-	
-	oryx_thread_mutex_unlock (&ch->nhlock);
-
-	return n;
+	return (int) lround (weight * ch->weight_vns);
 }
 
-/** Install a specified physical node to list. */
-void node_install (struct chash_root *ch, struct node_t *n)
+/** Install the virtual nodes $from .. $to - 1 of $n to vn_root, without publishing the ring. */
+static void _n_grow (struct chash_root *ch, struct node_t *n, int from, int to)
 {
 
 	int i;
 	size_t lo = 0;
-	uint32_t hv = 0;
+	ring_key_t hv = 0;
 	struct vnode_t *vn;
-	char v_idesc [32] = {0};
+	char v_idesc [VN_IDESC_SIZE] = {0};
+	unsigned char digest[16];
 
-	if (_n_add (ch, n)) {
-		printf ("%15s(%15s) has installed \n", n->idesc, n->ipaddr);
-		return;
-	}
+	/* A ketama digest yields four positions, get the one $from falls in. */
+	if (ch->hash_algo == HASH_ALGO_KETAMA && (from & 3))
+		_vn_hash (ch, n, from & ~3, v_idesc, &lo, digest);
 	
-	for (i = 0; i < n->replicas; i++) {
+	for (i = from; i < to; i++) {
 
-		memset (v_idesc, 0, 32);
+		memset (v_idesc, 0, sizeof (v_idesc));
 		lo = 0;
 		
-		_vn_fmt (n->ipaddr, i, v_idesc, &lo);
-		hv = ch->hash_func (v_idesc, lo);
+		hv = _vn_hash (ch, n, i, v_idesc, &lo, digest);
 		
-		vn = _vn_find (ch, (void *)(uint32_t *)&hv);
-		if (likely (vn)) {
-			printf ("%s_%u(%s) has added \n", v_idesc, VN_KEY_I(vn), n->ipaddr);
-			return;
+		/* Position collision, keep the owner and go on with the next
+		   virtual node. Hardly ever happens within a 64 bit ring. */
+		vn = _vn_find (ch, (void *)&hv);
+		if (unlikely (vn)) {
+			printf ("%s_%llu(%s) has added \n", v_idesc, (unsigned long long)VN_KEY_I(vn), n->ipaddr);
+			continue;
 		}
 		
 		/* Allocate a VN and inited VN with $hv and node */
-		vn = _vn_alloc (n, hv, i, v_idesc);
+		vn = _vn_alloc (n, hv, i, v_idesc, ch->vn_hits);
 		if (unlikely (!vn)) {
 			printf ("Can not alloc memory for %s\n", v_idesc);
-			return;
+			break;
 		}
 
-		if (!_vn_add (ch, n, vn)) {
+		if (unlikely (_vn_add (ch, n, vn))) {
+			free (vn->videsc);
+			free (vn->hits);
+			free (vn);
+			continue;
+		}
 
+		{
 			/** Init the maximun and minmum (of key) node */
 			if (ch->vn_max == NULL)
 				ch->vn_max = &vn->node;
@@ -591,199 +622,1315 @@ void node_install (struct chash_root *ch, struct node_t *n)
 
 }
 
-/** Lookup a physical node from list with a specified key. */
-struct node_t *node_lookup (struct chash_root *ch, char *key)
+/** Erase the virtual nodes of $n whose index is $from or greater from vn_root,
+	without publishing the ring. vn_min & vn_max must be refreshed by the caller. */
+static void _n_shrink (struct chash_root *ch, struct node_t *n, int from)
 {
-	uint32_t hv;
-	struct vnode_t *vn = NULL;
-	struct node_t *n = _vn_default(ch)->physical_node;
-
-	hv = ch->hash_func (key, strlen (key));
-	
-	vn = _vn_find_ring(ch, (void *)(uint32_t *)&hv);
-	if (likely(vn))
-		n = vn->physical_node;
-	else
-		printf ("Can not find vn with a (%s, %u)\n", key, hv);
-	
-	ch->total_hit_times ++;
-	N_HITS_INC(n);
-	
-	return n;
+	struct vnode_t *vn = NULL, *vp;
+
+	/* Only vnodes really inserted for $n are on its list,
+	   colliding positions owned by another node are not. */
+	list_for_each_entry_safe(vn, vp, &n->vnode_head, vnode) {
+		if (vn->index < from)
+			continue;
+		/* Readers only see ring snapshots, so the vnode goes at once.
+		   Its hit counters are reachable from them, they go later. */
+		rb_erase (&vn->node, &ch->vn_root);
+		list_del (&vn->vnode);
+		n->valid_vns --;
+		if (vn->hits)
+			epoch_retire (vn->hits, free);
+		free (vn->videsc);
+		free (vn);
+	}
 }
 
-/** Dump all physical node and statistics.*/
-void node_summary (struct chash_root *ch)
+/** Install a specified physical node to list and vn_root, without publishing the ring.
+	Returns -1 if a same machine is installed already. */
+static int _n_install (struct chash_root *ch, struct node_t *n)
 {
-	struct node_t *n1 = NULL, *p;
+	if (_n_add (ch, n)) {
+		printf ("%15s(%15s) has installed \n", n->idesc, n->ipaddr);
+		return -1;
+	}
 
-	printf ("\n\n\nTotal %15d(%-5d vns) machines\n", ch->total_ns, total_vns(ch));
+	if (n->weight > 0)
+		n->replicas = _n_weight_vns (ch, n->weight);
 
-	printf ("%15s%16s%4s%15s%15s\n", "MACHINE", "IPADDR", "VNS", "HIT", "RATIO");
-	oryx_thread_mutex_lock (&ch->nhlock);
-	
-	list_for_each_entry_safe(n1, p, &ch->node_head, node){
-		printf ("%15s%16s%4d%15d%15.2f%s\n", 
-					n1->idesc, n1->ipaddr, n1->valid_vns, N_HITS(n1), (float)N_HITS(n1)/ch->total_hit_times * 100, "%");
-	}
+	if (ch->engine->vn_grow)
+		ch->engine->vn_grow (ch, n, 0, n->replicas);
 
-	oryx_thread_mutex_unlock (&ch->nhlock);
+	return 0;
 }
 
-/** Dump all physical node.*/
-void node_dump (struct chash_root *ch)
+/** Change the count of virtual nodes of an installed node to $replicas, without
+	publishing the ring. Only the delta is added or removed, by index, so the
+	other virtual nodes keep their positions and their keys stay put. */
+static void _n_reweight (struct chash_root *ch, struct node_t *n, int replicas)
 {
-	printf ("\n\n===========Virtual Nodes (%d)============\n", total_vns(ch));
-	_vn_travel (ch, _vn_dump, NODE_FLG_CLASSFY_TRAVEL);
-}
+	/* Engines without virtual nodes (Maglev) place by replicas on publish. */
+	if (ch->engine->vn_grow) {
+		if (replicas < n->replicas)
+			ch->engine->vn_shrink (ch, n, replicas);
+		else
+			ch->engine->vn_grow (ch, n, n->replicas, replicas);
+	}
 
-/** Physical node configuration.*/
-void node_set (struct node_t *n, char *desc, char *ipaddr, int replicas)
-{
-	memcpy ((void *)&n->idesc[0], desc, strlen(desc));
-	memcpy ((void *)&n->ipaddr[0], ipaddr, strlen(ipaddr));
-	n->flags = NODE_FLG_INITED;
 	n->replicas = replicas;
-	INIT_LIST_HEAD (&n->node);
+
+	ch->vn_min = rb_first (&ch->vn_root);
+	ch->vn_max = rb_last (&ch->vn_root);
 }
 
-void chcopy (struct chash_root **new, struct chash_root *old)
+/** Distinct nodes clockwise from $hv, from the successor table of the snapshot with
+	a single search if it holds $n of them, or by walking the ring slots otherwise. */
+static int _ring_lookup_replicas (const struct ring_t *r, ring_key_t hv, int n, int *idx)
 {
+	int i, j, m = 0, slot;
+	const uint32_t *s;
 
-	struct chash_root *backup;
-	struct node_t *n1 = NULL, *p;
+	if (unlikely (!r->nvns))
+		return 0;
 
-	backup = chash_init ();
-	
-	list_for_each_entry_safe(n1, p, &old->node_head, node){
-		struct node_t *shadow;
-		shadow = _n_clone (n1);
-		node_install (backup, shadow);
+	slot = ring_find_slot (r, hv);
+
+	if (likely (n <= r->nsucc)) {
+		s = &r->succ[slot * r->nsucc];
+		for (m = 0; m < n && s[m] != UINT32_MAX; m ++)
+			idx[m] = (int)s[m];
+		return m;
 	}
 
-	*new = backup;
+	/* Adjacent slots often belong to a node taken already. */
+	for (i = 0; i < r->nvns && m < n; i ++) {
+		for (j = 0; j < m && idx[j] != (int)r->idx[slot]; j ++);
+		if (j == m)
+			idx[m ++] = (int)r->idx[slot];
+		if (++ slot == r->nvns)
+			slot = 0;
+	}
+
+	return m;
 }
 
-void check_miss_while_add ()
+/** Consistent hash ring engine, virtual nodes on vn_root searched in the flat snapshot. Default. */
+const struct chash_engine_t chash_engine_ring = {
+	.name = "ring",
+	.vn_grow = _n_grow,
+	.vn_shrink = _n_shrink,
+	.lookup = NULL,
+	.lookup_replicas = _ring_lookup_replicas,
+	.build = NULL,
+	.weighted = 1,
+};
+
+/** Remove a specified physical node from list.
+	Erase all its virtual node and update gloable default virtual node,
+	in O(R log V) for R virtual nodes of the removed one, without hashing.
+	Returns after all lookups which may still see the node have finished,
+	so the caller can free it right away. Returns NULL if there is no such node,
+	or if the ring can not be republished for lack of memory, the node is then
+	put back as it was since the published snapshot still holds it. */
+struct node_t *node_remove (struct chash_root *ch, char *nodekey)
 {
+	struct node_t *n;
+	struct list_head *prev;
 
-	int i;
-	uint32_t hv;
-	uint32_t intp = 0;
-	char key[32] = {0};
-	struct chash_root *chnew = NULL, *ch = NULL;
-	char *colur = CONSOLE_PRINT_CLOR_LWHITE;
-	struct node_t *n = NULL, *new = NULL;
-	struct vnode_t *vn = NULL, *vn_backup = NULL;
+	oryx_thread_mutex_lock (&ch->wrlock);
 
-	chnew = ch_add;
-	chcopy (&ch, chnew);
-	
-	changes = 0;
-	
-	new = _n_new ();
-	if (likely (new)) {
-		node_install (ch, new);
-		printf ("\n\n\n\nTrying to add a node ... \"%s\", done, total_vns=%d\n", 
-			new->ipaddr, total_vns(ch));
+	/* Find the physical node by $nodekey  */
+	n = _n_find (ch, nodekey);
+	if (unlikely (!n)) {
+		oryx_thread_mutex_unlock (&ch->wrlock);
+		return NULL;
 	}
 
-	for (i = 0; i < MAX_INJECT_DATA; i ++) {
-		memset ((void *)&key[0], 0, 32);
-		sprintf (key, "2.%d.%d.%d", 
-			((i * next_rand_(&intp)) % 255),
-			((i * next_rand_(&intp)) % 255),
-			((i * next_rand_(&intp)) % 255));
+	prev = n->node.prev;
+	if (ch->engine->vn_shrink)
+		ch->engine->vn_shrink (ch, n, 0);
+	_n_del (ch, n);
 
-		hv = ch->hash_func (key, strlen (key));
-		
-		vn = _vn_find_ring(ch, (void *)(uint32_t *)&hv);
-		if (likely(vn))
-			n = vn->physical_node;
-		
-		if (likely(n)) {
-			ch->total_hit_times ++;
-			N_HITS_INC(n);
-			//printf ("[%16s] is in node: [%16s]\n", key, n->idesc);
-		}
-		
-		vn_backup = _vn_find_ring (chnew, (void *)(uint32_t *)&hv);
-		vn = _vn_find_ring(ch, (void *)(uint32_t *)&hv);
+	ch->vn_min = rb_first (&ch->vn_root);
+	ch->vn_max = rb_last (&ch->vn_root);
 
-		if (oryx_strcmp_native (
-				((struct node_t *)vn->physical_node)->idesc, 
-				((struct node_t *)vn_backup->physical_node)->idesc)) 
-			changes ++;
-		
-	};
+	if (unlikely (ring_publish (ch))) {
+		_n_undel (ch, n, prev);
+		ch->vn_min = rb_first (&ch->vn_root);
+		ch->vn_max = rb_last (&ch->vn_root);
+		oryx_thread_mutex_unlock (&ch->wrlock);
+		return NULL;
+	}
 
-	if (changes <= THRESHOLD_L1(MAX_INJECT_DATA))
-		colur = CONSOLE_PRINT_CLOR_LWHITE;
-	
-	if ((changes > THRESHOLD_L1(MAX_INJECT_DATA)) && (changes <= THRESHOLD_L2(MAX_INJECT_DATA)))
-		colur = CONSOLE_PRINT_CLOR_LYELLOW;
+	oryx_thread_mutex_unlock (&ch->wrlock);
 
-	if (changes >= THRESHOLD_L2(MAX_INJECT_DATA))
-		colur = CONSOLE_PRINT_CLOR_LRED;
-	
-	printf ("\nAdding ...%18s (%s)\n Changes (%-8u%s%-4.2f%s"CONSOLE_PRINT_CLOR_FIN")\n\n", 
-		new->ipaddr, new->idesc, 
-		changes, colur, (float)changes/MAX_INJECT_DATA * 100, "%");
+	/* Wait for lookups which may still hold $n through the old snapshot. */
+	epoch_synchronize ();
 
+	return n;
 }
 
-void check_miss_while_rm ()
+/** Install a specified physical node to list. Returns 0, or -1 if a same machine
+	is installed already or the ring can not be republished for lack of memory,
+	the node is then taken out again as it was. */
+int node_install (struct chash_root *ch, struct node_t *n)
 {
+	int replicas = n->replicas;
 
-	int i;
-	uint32_t hv;
-	uint32_t intp = 0;
-	char key[32] = {0};
-	struct chash_root *chnew = NULL, *ch = NULL;
-	char *colur = CONSOLE_PRINT_CLOR_LWHITE;
-	struct node_t *n = NULL;
-	struct vnode_t *vn = NULL, *vn_backup = NULL;
-	struct node_t *removed_node = &backend_node[1];
+	oryx_thread_mutex_lock (&ch->wrlock);
 
-	chnew = ch_del;
-	chcopy (&ch, chnew);
-	
-	changes = 0;
-	
-	n = node_remove (ch, removed_node->ipaddr);
+	if (unlikely (_n_install (ch, n))) {
+		oryx_thread_mutex_unlock (&ch->wrlock);
+		return -1;
+	}
 
-	printf ("\n\n\n\nTrying to remove a node ... \"%s\", done, total_vns=%d\n", 
-		n->idesc, total_vns(ch));
+	if (unlikely (ring_publish (ch))) {
+		if (ch->engine->vn_shrink)
+			ch->engine->vn_shrink (ch, n, 0);
+		_n_del (ch, n);
+		n->replicas = replicas;
+		ch->vn_min = rb_first (&ch->vn_root);
+		ch->vn_max = rb_last (&ch->vn_root);
+		oryx_thread_mutex_unlock (&ch->wrlock);
+		return -1;
+	}
 
-	free (n);
+	oryx_thread_mutex_unlock (&ch->wrlock);
+
+	return 0;
+}
+
+/*
+  * Bulk build job structure definnition.
+  * Virtual nodes of nodes[from .. to) are hashed and allocated by one thread,
+  * the j-th replica of nodes[k] goes to ents[off[k] + j].
+  */
+struct build_job_t {
+
+	pthread_t tid;
+
+	int threaded;	/** Run by $tid, otherwise by the caller of chash_build. */
+
+	struct chash_root *ch;
+
+	struct node_t **nodes;
+
+	int from, to;
+
+	int *off;		/** Offset of the first entry of each node, -1 for skipped nodes. */
+
+	struct build_ent_t *ents;
+};
+
+/*
+  * Bulk build entry structure definnition.
+  * Sorted by key, the vnode pointer is carried along so that the sort
+  * never dereferences it.
+  */
+struct build_ent_t {
+
+	ring_key_t key;
+
+	struct vnode_t *vn;	/** NULL if it could not be allocated. */
+};
+
+/** Hash and allocate the virtual nodes of a build job. */
+static void *_build_hash (void *arg)
+{
+	struct build_job_t *job = (struct build_job_t *)arg;
+	struct chash_root *ch = job->ch;
+	struct build_ent_t *e;
+	struct node_t *n;
+	char v_idesc [VN_IDESC_SIZE];
+	unsigned char digest[16];
+	size_t lo;
+	int k, i;
+
+	for (k = job->from; k < job->to; k ++) {
+		if (job->off[k] < 0 || !ch->engine->vn_grow)
+			continue;
+
+		n = job->nodes[k];
+		e = &job->ents[job->off[k]];
+		for (i = 0; i < n->replicas; i ++) {
+			memset (v_idesc, 0, sizeof (v_idesc));
+			e[i].key = _vn_hash (ch, n, i, v_idesc, &lo, digest);
+			e[i].vn = _vn_alloc (n, e[i].key, i, v_idesc, ch->vn_hits);
+		}
+	}
+
+	return NULL;
+}
+
+/** LSD radix sort of $n entries by key, 8 bits a pass, stable so that colliding
+	positions keep the order they were hashed in. Passes in which all keys share
+	the digit are skipped. $tmp must hold $n entries. Returns the sorted array,
+	$ents or $tmp. */
+static struct build_ent_t *_build_sort (struct build_ent_t *ents, struct build_ent_t *tmp, int n)
+{
+	int i, d;
+	uint32_t cnt[256], sum, c;
+	struct build_ent_t *src = ents, *dst = tmp, *t;
+
+	for (d = 0; d < (int)RING_KEY_BITS; d += 8) {
+		memset (cnt, 0, sizeof (cnt));
+		for (i = 0; i < n; i ++)
+			cnt[(src[i].key >> d) & 0xFF] ++;
+
+		if (n == 0 || cnt[(src[0].key >> d) & 0xFF] == (uint32_t)n)
+			continue;
+
+		for (i = 0, sum = 0; i < 256; i ++) {
+			c = cnt[i];
+			cnt[i] = sum;
+			sum += c;
+		}
+
+		for (i = 0; i < n; i ++)
+			dst[cnt[(src[i].key >> d) & 0xFF] ++] = src[i];
+
+		t = src; src = dst; dst = t;
+	}
+
+	return src;
+}
+
+/** Link vns[lo .. hi) into a balanced subtree under $parent in O(hi - lo).
+	Nodes at $red_depth are colored red, all others black, which satisfies the
+	red black rules since every leaf is at depth $red_depth or $red_depth - 1. */
+static struct rb_node *_build_tree (struct vnode_t **vns, int lo, int hi,
+			struct rb_node *parent, int depth, int red_depth)
+{
+	int mid;
+	struct rb_node *rbn;
+
+	if (lo >= hi)
+		return NULL;
+
+	mid = lo + (hi - lo) / 2;
+	rbn = &vns[mid]->node;
+	rb_set_parent (rbn, parent);
+	rb_set_color (rbn, depth == red_depth ? RB_RED : RB_BLACK);
+	rbn->rb_left = _build_tree (vns, lo, mid, rbn, depth + 1, red_depth);
+	rbn->rb_right = _build_tree (vns, mid + 1, hi, rbn, depth + 1, red_depth);
+
+	return rbn;
+}
+
+/** Replace vn_root of $ch with a balanced tree of $n virtual nodes sorted by key,
+	complete down to the last level which is red unless it is full. O(n). */
+static void _vn_relink (struct chash_root *ch, struct vnode_t **vns, int n)
+{
+	int red_depth;
+
+	for (red_depth = 0; (2 << red_depth) <= n + 1; red_depth ++);
+	if ((1 << red_depth) == n + 1)
+		red_depth = -1;
+
+	ch->vn_root.rb_node = _build_tree (vns, 0, n, NULL, 0, red_depth);
+	ch->vn_min = n ? &vns[0]->node : NULL;
+	ch->vn_max = n ? &vns[n - 1]->node : NULL;
+}
+
+/** Order nodes by ipaddr, then by their rank so that the first of duplicates wins. */
+static int _build_ncmp (const void *a, const void *b)
+{
+	const struct node_t *x = *(struct node_t * const *)a, *y = *(struct node_t * const *)b;
+	int r = strcmp (x->ipaddr, y->ipaddr);
+
+	return r ? r : (x->id > y->id) - (x->id < y->id);
+}
+
+/** Install $n physical nodes at once, e.g. at cold start, and publish the ring once.
+	Instead of a tree probe, a rebalancing insert and a min/max update per virtual node,
+	all positions are hashed (across ch->build_threads threads), sorted once with a
+	radix sort, merged with the installed ones, and vn_root is relinked in linear time.
+	Position collisions and machines already installed are skipped as by node_install.
+	Returns 0, or -1 if nothing was installed for lack of memory, the ring is then as
+	it was and $nodes keep their replicas. */
+int chash_build (struct chash_root *ch, struct node_t **nodes, int n)
+{
+	int i, j, k, nvns = 0, nold, nnew, nall, nthreads, ret = 0;
+	int *off, *reps;
+	struct node_t **all, *n1, *p;
+	struct build_job_t *jobs;
+	struct build_ent_t *ents, *tmp, *sorted;
+	struct vnode_t **vns, *vn;
+	struct rb_node *rbn;
+	ring_key_t last = 0;
+
+	oryx_thread_mutex_lock (&ch->wrlock);
+
+	nold = 0;
+	for (rbn = rb_first (&ch->vn_root); rbn; rbn = rb_next (rbn))
+		nold ++;
+
+	/* Machines already installed rank first, then $nodes in order. */
+	all = (struct node_t **) malloc (sizeof (struct node_t *) * (ch->total_ns + n + 1));
+	off = (int *) malloc (sizeof (int) * (n + 1));
+	reps = (int *) malloc (sizeof (int) * (n + 1));
+	nthreads = MIN (MAX (ch->build_threads, 1), MAX (n, 1));
+	jobs = (struct build_job_t *) malloc (sizeof (struct build_job_t) * nthreads);
+	if (unlikely (!all || !off || !reps || !jobs)) {
+		free (all); free (off); free (reps); free (jobs);
+		oryx_thread_mutex_unlock (&ch->wrlock);
+		printf ("Can not alloc memory. \n");
+		return -1;
+	}
+
+	nall = 0;
+	list_for_each_entry_safe (n1, p, &ch->node_head, node) {
+		n1->id = -1;
+		all[nall ++] = n1;
+	}
+	for (k = 0; k < n; k ++) {
+		nodes[k]->id = k;
+		all[nall ++] = nodes[k];
+		off[k] = 0;
+		reps[k] = nodes[k]->replicas;
+	}
+
+	qsort (all, nall, sizeof (struct node_t *), _build_ncmp);
+	for (i = 1; i < nall; i ++) {
+		if (!strcmp (all[i]->ipaddr, all[i - 1]->ipaddr) && all[i]->id >= 0) {
+			printf ("%15s(%15s) has installed \n", all[i]->idesc, all[i]->ipaddr);
+			off[all[i]->id] = -1;
+		}
+	}
+
+	for (k = 0; k < n; k ++) {
+		if (off[k] < 0)
+			continue;
+		if (nodes[k]->weight > 0)
+			nodes[k]->replicas = _n_weight_vns (ch, nodes[k]->weight);
+		off[k] = nvns;
+		if (ch->engine->vn_grow)
+			nvns += MAX (nodes[k]->replicas, 0);
+	}
+
+	ents = (struct build_ent_t *) malloc (sizeof (struct build_ent_t) * (nvns + 1));
+	tmp = (struct build_ent_t *) malloc (sizeof (struct build_ent_t) * (nvns + 1));
+	vns = (struct vnode_t **) malloc (sizeof (struct vnode_t *) * (nold + nvns + 1));
+	if (unlikely (!ents || !tmp || !vns)) {
+		free (all); free (off); free (reps); free (jobs);
+		free (ents); free (tmp); free (vns);
+		oryx_thread_mutex_unlock (&ch->wrlock);
+		printf ("Can not alloc memory. \n");
+		return -1;
+	}
+
+	/* Hash, each thread takes a contiguous range of nodes. */
+	for (j = 0; j < nthreads; j ++) {
+		jobs[j].ch = ch;
+		jobs[j].nodes = nodes;
+		jobs[j].off = off;
+		jobs[j].ents = ents;
+		jobs[j].from = (int)((int64_t)n * j / nthreads);
+		jobs[j].to = (int)((int64_t)n * (j + 1) / nthreads);
+		jobs[j].threaded = (j > 0 && !pthread_create (&jobs[j].tid, NULL, _build_hash, &jobs[j]));
+	}
+	for (j = nthreads - 1; j >= 0; j --) {
+		if (jobs[j].threaded)
+			pthread_join (jobs[j].tid, NULL);
+		else
+			_build_hash (&jobs[j]);
+	}
+
+	sorted = _build_sort (ents, tmp, nvns);
+
+	/* New physical nodes go to the list before their virtual nodes. */
+	oryx_thread_mutex_lock (&ch->nhlock);
+	for (k = 0; k < n; k ++) {
+		if (off[k] >= 0)
+			_n_link (ch, nodes[k]);
+	}
+	oryx_thread_mutex_unlock (&ch->nhlock);
+
+	/* Merge with the installed virtual nodes, the installed one or the first
+	   hashed one keeps a colliding position, as node_install does. */
+	rbn = rb_first (&ch->vn_root);
+	for (i = 0, nnew = 0; rbn || i < nvns; ) {
+		if (i < nvns && !sorted[i].vn) {
+			printf ("Can not alloc memory for a virtual node\n");
+			i ++;
+			continue;
+		}
+
+		if (rbn && (i == nvns || VN_KEY_I(rb_entry (rbn, struct vnode_t, node)) <= sorted[i].key)) {
+			vn = rb_entry (rbn, struct vnode_t, node);
+			rbn = rb_next (rbn);
+		} else {
+			vn = sorted[i ++].vn;
+			if (nnew && VN_KEY_I(vn) == last) {
+				printf ("%s_%llu(%s) has added \n", vn->videsc, (unsigned long long)VN_KEY_I(vn),
+					((struct node_t *)vn->physical_node)->ipaddr);
+				free (vn->videsc);
+				free (vn->hits);
+				free (vn);
+				continue;
+			}
+			N_VALID_VNS_INC((struct node_t *)vn->physical_node);
+			list_add_tail (&vn->vnode, &((struct node_t *)vn->physical_node)->vnode_head);
+		}
+
+		last = VN_KEY_I(vn);
+		vns[nnew ++] = vn;
+	}
+
+	_vn_relink (ch, vns, nnew);
+
+	/* The published snapshot holds none of $nodes, take them out again. */
+	if (unlikely (ring_publish (ch))) {
+		for (k = 0; k < n; k ++) {
+			if (off[k] < 0)
+				continue;
+			if (ch->engine->vn_shrink)
+				ch->engine->vn_shrink (ch, nodes[k], 0);
+			_n_del (ch, nodes[k]);
+			nodes[k]->replicas = reps[k];
+		}
+		ch->vn_min = rb_first (&ch->vn_root);
+		ch->vn_max = rb_last (&ch->vn_root);
+		ret = -1;
+	}
+
+	oryx_thread_mutex_unlock (&ch->wrlock);
+
+	free (all);
+	free (off);
+	free (reps);
+	free (jobs);
+	free (ents);
+	free (tmp);
+	free (vns);
+
+	return ret;
+}
+
+/** Change the weight of the installed node $nodekey in place. Only the delta
+	virtual nodes are added or removed, so only the keys of the share gained or
+	lost move, O(delta log V). Returns 0, or -1 if there is no such node, the
+	engine (e.g. jump) has no weights or the ring can not be republished,
+	in which case the node keeps its weight. */
+int node_reweight (struct chash_root *ch, char *nodekey, double weight)
+{
+	int replicas;
+	double prev;
+	struct node_t *n;
+
+	if (unlikely (weight < 0 || !ch->engine->weighted))
+		return -1;
+
+	oryx_thread_mutex_lock (&ch->wrlock);
+
+	n = _n_find (ch, nodekey);
+	if (unlikely (!n)) {
+		oryx_thread_mutex_unlock (&ch->wrlock);
+		return -1;
+	}
+
+	prev = n->weight;
+	replicas = n->replicas;
+	n->weight = weight;
+	_n_reweight (ch, n, _n_weight_vns (ch, weight));
+
+	if (unlikely (ring_publish (ch))) {
+		n->weight = prev;
+		_n_reweight (ch, n, replicas);
+		oryx_thread_mutex_unlock (&ch->wrlock);
+		return -1;
+	}
+
+	oryx_thread_mutex_unlock (&ch->wrlock);
+
+	return 0;
+}
+
+/** Start staging membership changes of $ch. Returns NULL if out of memory. */
+struct chash_txn_t *chash_txn_begin (struct chash_root *ch)
+{
+	struct chash_txn_t *txn;
+
+	txn = (struct chash_txn_t *) malloc (sizeof (struct chash_txn_t));
+	if (unlikely (!txn))
+		return NULL;
+
+	memset (txn, 0, sizeof (struct chash_txn_t));
+	txn->ch = ch;
+
+	return txn;
+}
+
+/** Stage an operation, growing the array of $txn if needed. */
+static struct chash_txn_op_t *_txn_op (struct chash_txn_t *txn, int op)
+{
+	int size;
+	struct chash_txn_op_t *ops;
+
+	if (txn->nops == txn->size) {
+		size = txn->size ? txn->size * 2 : 16;
+		ops = (struct chash_txn_op_t *) realloc (txn->ops, sizeof (struct chash_txn_op_t) * size);
+		if (unlikely (!ops))
+			return NULL;
+		txn->ops = ops;
+		txn->size = size;
+	}
+
+	ops = &txn->ops[txn->nops ++];
+	memset (ops, 0, sizeof (struct chash_txn_op_t));
+	ops->op = op;
+
+	return ops;
+}
+
+/** Stage the install of $n (see node_install). Returns 0, or -1 if out of memory. */
+int chash_txn_add (struct chash_txn_t *txn, struct node_t *n)
+{
+	struct chash_txn_op_t *op = _txn_op (txn, CHASH_TXN_ADD);
+
+	if (unlikely (!op))
+		return -1;
+
+	op->n = n;
+
+	return 0;
+}
+
+/** Stage the removal of the node $nodekey (see node_remove). Returns 0, or -1 if out of memory. */
+int chash_txn_remove (struct chash_txn_t *txn, char *nodekey)
+{
+	struct chash_txn_op_t *op = _txn_op (txn, CHASH_TXN_REMOVE);
+
+	if (unlikely (!op))
+		return -1;
+
+	memcpy (op->ipaddr, nodekey, MIN (strlen (nodekey), sizeof (op->ipaddr) - 1));
+
+	return 0;
+}
+
+/** Stage a new $weight for the node $nodekey, see node_reweight.
+	Returns 0, or -1 if out of memory or $weight is negative. */
+int chash_txn_set_weight (struct chash_txn_t *txn, char *nodekey, double weight)
+{
+	struct chash_txn_op_t *op;
+
+	if (unlikely (weight < 0))
+		return -1;
+
+	op = _txn_op (txn, CHASH_TXN_WEIGHT);
+	if (unlikely (!op))
+		return -1;
+
+	memcpy (op->ipaddr, nodekey, MIN (strlen (nodekey), sizeof (op->ipaddr) - 1));
+	op->weight = weight;
+
+	return 0;
+}
+
+/** Drop the staged changes of $txn and free it. */
+void chash_txn_abort (struct chash_txn_t *txn)
+{
+	if (unlikely (!txn))
+		return;
+
+	free (txn->ops);
+	free (txn);
+}
+
+/** Undo the applied changes of $txn in reverse order, so that every one of them
+	finds $ch as it left it, e.g. a removed node is put back after the entry it
+	followed. vn_root is then the one the published snapshot was built from. */
+static void _txn_rollback (struct chash_root *ch, struct chash_txn_t *txn)
+{
+	int i;
+	struct chash_txn_op_t *op;
+
+	for (i = txn->nops - 1; i >= 0; i --) {
+		op = &txn->ops[i];
+		if (!op->applied)
+			continue;
+
+		switch (op->op) {
+		case CHASH_TXN_ADD:
+			if (ch->engine->vn_shrink)
+				ch->engine->vn_shrink (ch, op->n, 0);
+			_n_del (ch, op->n);
+			op->n->replicas = op->prev_replicas;
+			break;
+
+		case CHASH_TXN_REMOVE:
+			_n_undel (ch, op->n, op->prev);
+			break;
+
+		case CHASH_TXN_WEIGHT:
+			op->n->weight = op->prev_weight;
+			_n_reweight (ch, op->n, op->prev_replicas);
+			break;
+		}
+	}
+
+	ch->vn_min = rb_first (&ch->vn_root);
+	ch->vn_max = rb_last (&ch->vn_root);
+}
+
+/** Apply the staged changes of $txn in order and publish the ring once.
+	Each change costs what it costs alone, O(R log V) for R virtual nodes,
+	min/max are refreshed and the ring is rebuilt once for all of them.
+	Lookups see either the ring before the transaction or after it.
+	The node removed by the i-th remove is stored in $removed[i] (NULL if there
+	was no such node), it can be freed once this returns, as with node_remove.
+	$removed may be NULL if there is no remove. $txn is freed.
+	Returns the count of changes which could not be applied, or -1 if the ring
+	can not be republished for lack of memory, all changes are then rolled back
+	and $removed is all NULL, since the published snapshot still holds them. */
+int chash_txn_commit (struct chash_txn_t *txn, struct node_t **removed)
+{
+	int i, r = 0, failed = 0;
+	struct chash_root *ch = txn->ch;
+	struct chash_txn_op_t *op;
+	struct node_t *n;
+
+	oryx_thread_mutex_lock (&ch->wrlock);
+
+	for (i = 0; i < txn->nops; i ++) {
+		op = &txn->ops[i];
+
+		switch (op->op) {
+		case CHASH_TXN_ADD:
+			op->prev_replicas = op->n->replicas;
+			if (_n_install (ch, op->n))
+				failed ++;
+			else
+				op->applied = 1;
+			break;
+
+		case CHASH_TXN_REMOVE:
+			n = _n_find (ch, op->ipaddr);
+			if (removed)
+				removed[r] = n;
+			r ++;
+			if (unlikely (!n)) {
+				failed ++;
+				break;
+			}
+			op->n = n;
+			op->prev = n->node.prev;
+			op->applied = 1;
+			if (ch->engine->vn_shrink)
+				ch->engine->vn_shrink (ch, n, 0);
+			_n_del (ch, n);
+			break;
+
+		case CHASH_TXN_WEIGHT:
+			n = _n_find (ch, op->ipaddr);
+			if (unlikely (!n || !ch->engine->weighted)) {
+				failed ++;
+				break;
+			}
+			op->n = n;
+			op->prev_weight = n->weight;
+			op->prev_replicas = n->replicas;
+			op->applied = 1;
+			n->weight = op->weight;
+			_n_reweight (ch, n, _n_weight_vns (ch, op->weight));
+			break;
+		}
+	}
+
+	ch->vn_min = rb_first (&ch->vn_root);
+	ch->vn_max = rb_last (&ch->vn_root);
+
+	if (unlikely (ring_publish (ch))) {
+		_txn_rollback (ch, txn);
+		oryx_thread_mutex_unlock (&ch->wrlock);
+		if (removed)
+			memset (removed, 0, sizeof (struct node_t *) * r);
+		chash_txn_abort (txn);
+		return -1;
+	}
+
+	oryx_thread_mutex_unlock (&ch->wrlock);
+
+	/* Wait for lookups which may still hold removed nodes through the old snapshot. */
+	if (r)
+		epoch_synchronize ();
+
+	chash_txn_abort (txn);
+
+	return failed;
+}
+
+/** Lookup a physical node from list with a hash value $hv which is already
+	computed by the caller (e.g. by a NIC or an upstream tier) with ch->hash_func.
+	Lock-free, safe against concurrent node_install and node_remove.
+	The node stays valid until the read section of the caller, if any, is left.
+	Returns NULL if the ring is empty. */
+struct node_t *node_lookup_hv (struct chash_root *ch, ring_key_t hv)
+{
+	int slot;
+	struct node_t *n = NULL;
+	struct ring_t *r;
+
+	epoch_read_lock ();
+
+	/* Hot path, search the flat snapshot and never touch vn_root. */
+	r = ring_deref (ch);
+	if (likely (r)) {
+		if (unlikely (r->engine->lookup)) {
+			if (likely (r->nns))
+				n = r->nodes[r->engine->lookup (r, hv)];
+		} else if (likely (r->nvns)) {
+			slot = ring_find_slot (r, hv);
+			n = r->nodes[r->idx[slot]];
+			if (unlikely (r->vhits) && r->vhits[slot])
+				hits_inc (r->vhits[slot]);
+		}
+	}
+
+	/* Empty ring. */
+	if (unlikely (!n)) {
+		epoch_read_unlock ();
+		return NULL;
+	}
 	
-	for (i = 0; i < MAX_INJECT_DATA; i ++) {
-		memset ((void *)&key[0], 0, 32);
-		sprintf (key, "2.%d.%d.%d", 
-			((i * next_rand_(&intp)) % 255),
-			((i * next_rand_(&intp)) % 255),
-			((i * next_rand_(&intp)) % 255));
+	N_HITS_INC(n);
 
-		hv = ch->hash_func (key, strlen (key));
-		
-		vn = _vn_find_ring(ch, (void *)(uint32_t *)&hv);
-		if (likely(vn))
-			n = vn->physical_node;
-		
-		if (likely(n)) {
-			ch->total_hit_times ++;
-			N_HITS_INC(n);
-			//printf ("[%16s] is in node: [%16s]\n", key, n->idesc);
+	epoch_read_unlock ();
+	
+	return n;
+}
+
+/** Lookup a physical node from list with a binary key of $len bytes,
+	which may contain embedded zeros. */
+struct node_t *node_lookup_n (struct chash_root *ch, const void *key, size_t len)
+{
+	return node_lookup_hv (ch, ch->hash_func ((char *)key, len));
+}
+
+/** Lookup a physical node from list with a specified NUL-terminated key. */
+struct node_t *node_lookup (struct chash_root *ch, char *key)
+{
+	return node_lookup_hv (ch, ch->hash_func (key, strlen (key)));
+}
+
+/** Lookup up to $n distinct physical nodes for a hash value $hv, owner first,
+	e.g. the replica set of a key. The ring returns them clockwise, with a single
+	search and $n table reads if ch->ring_replicas is $n or more, up to 3 by default. HRW returns them
+	by score, jump and Maglev only return the owner. Returns the count of nodes in $out, 0 if there is none. Only the
+	owner is counted as a hit. Nodes stay valid as those of node_lookup_hv. */
+int node_lookup_replicas_hv (struct chash_root *ch, ring_key_t hv, int n, struct node_t **out)
+{
+	int i, m;
+	int idx[NODE_REPLICAS_MAX];
+	struct ring_t *r;
+
+	n = MIN (n, NODE_REPLICAS_MAX);
+	if (unlikely (n <= 0))
+		return 0;
+
+	epoch_read_lock ();
+
+	r = ring_deref (ch);
+	if (likely (r) && r->engine->lookup_replicas) {
+		m = r->engine->lookup_replicas (r, hv, n, idx);
+		for (i = 0; i < m; i ++)
+			out[i] = r->nodes[idx[i]];
+		if (likely (m))
+			N_HITS_INC(out[0]);
+		epoch_read_unlock ();
+		return m;
+	}
+
+	epoch_read_unlock ();
+
+	out[0] = node_lookup_hv (ch, hv);
+
+	return out[0] ? 1 : 0;
+}
+
+/** Lookup up to $n distinct physical nodes for a NUL-terminated key, see node_lookup_replicas_hv. */
+int node_lookup_replicas (struct chash_root *ch, char *key, int n, struct node_t **out)
+{
+	return node_lookup_replicas_hv (ch, ch->hash_func (key, strlen (key)), n, out);
+}
+
+/** Take one in-flight request on $n if it holds less than $cap already. */
+static __oryx_always_inline__
+int _n_try_acquire (struct node_t *n, int64_t cap)
+{
+	int64_t load = __atomic_load_n (&n->load, __ATOMIC_RELAXED);
+
+	while (load < cap) {
+		if (__atomic_compare_exchange_n (&n->load, &load, load + 1,
+				1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return 1;
+	}
+
+	return 0;
+}
+
+/** Consistent hashing with bounded loads. Lookup the physical node of $hv as
+	node_lookup_hv does, but if it already holds ceil (c * average) in-flight
+	requests, for c the ch->load_factor, walk clockwise (the next ring slot, or
+	the next node for engines without a ring) to the first node under the cap.
+	The request is counted on the returned node until node_release.
+	Returns NULL if there is no node. */
+struct node_t *node_acquire_hv (struct chash_root *ch, ring_key_t hv)
+{
+	int i, slot, idx;
+	int64_t cap = INT64_MAX;
+	struct node_t *n = NULL, *owner;
+	struct ring_t *r;
+
+	epoch_read_lock ();
+
+	r = ring_deref (ch);
+	if (unlikely (!r || (r->engine->lookup ? !r->nns : !r->nvns))) {
+		epoch_read_unlock ();
+		return NULL;
+	}
+
+	if (ch->load_factor > 0)
+		cap = (int64_t) ceil (ch->load_factor *
+			(__atomic_load_n (&ch->load_total, __ATOMIC_RELAXED) + 1) / r->nns);
+
+	if (likely (!r->engine->lookup)) {
+		slot = ring_find_slot (r, hv);
+		owner = r->nodes[r->idx[slot]];
+		for (i = 0; i < r->nvns && !n; i ++) {
+			if (_n_try_acquire (r->nodes[r->idx[slot]], cap))
+				n = r->nodes[r->idx[slot]];
+			if (++ slot == r->nvns)
+				slot = 0;
 		}
-		
-		vn_backup = _vn_find_ring (chnew, (void *)(uint32_t *)&hv);
-		vn = _vn_find_ring(ch, (void *)(uint32_t *)&hv);
+	} else {
+		idx = r->engine->lookup (r, hv);
+		owner = r->nodes[idx];
+		for (i = 0; i < r->nns && !n; i ++) {
+			if (_n_try_acquire (r->nodes[idx], cap))
+				n = r->nodes[idx];
+			if (++ idx == r->nns)
+				idx = 0;
+		}
+	}
 
-		if (oryx_strcmp_native (
-				((struct node_t *)vn->physical_node)->idesc, 
-				((struct node_t *)vn_backup->physical_node)->idesc)) 
-			changes ++;
-		
+	/* Requests acquired concurrently took every node to the cap, overload the owner. */
+	if (unlikely (!n)) {
+		n = owner;
+		__atomic_fetch_add (&n->load, 1, __ATOMIC_ACQ_REL);
+	}
+
+	__atomic_fetch_add (&ch->load_total, 1, __ATOMIC_RELAXED);
+	N_HITS_INC(n);
+
+	epoch_read_unlock ();
+
+	return n;
+}
+
+/** Consistent hashing with bounded loads for a NUL-terminated key, see node_acquire_hv. */
+struct node_t *node_acquire (struct chash_root *ch, char *key)
+{
+	return node_acquire_hv (ch, ch->hash_func (key, strlen (key)));
+}
+
+/** Give back an in-flight request taken on $n by node_acquire. Requests must be
+	released before a removed node is freed. */
+void node_release (struct chash_root *ch, struct node_t *n)
+{
+	__atomic_fetch_sub (&n->load, 1, __ATOMIC_RELEASE);
+	__atomic_fetch_sub (&ch->load_total, 1, __ATOMIC_RELEASE);
+}
+
+/** Lookup physical nodes for $n hash values at once, the ring searches are
+	interleaved so their cache misses overlap. $out[i] is the node of $hv[i]. */
+void node_lookup_batch_hv (struct chash_root *ch, const ring_key_t *hv, int n, struct node_t **out)
+{
+	int i, j, m;
+	int slot[RING_BATCH];
+	struct ring_t *r;
+
+	epoch_read_lock ();
+
+	r = ring_deref (ch);
+
+	for (i = 0; i < n; i += RING_BATCH) {
+		m = MIN (RING_BATCH, n - i);
+
+		if (likely (r) && unlikely (r->engine->lookup)) {
+			for (j = 0; j < m; j ++)
+				out[i + j] = r->nns ? r->nodes[r->engine->lookup (r, hv[i + j])] : NULL;
+		} else if (likely (r && r->nvns)) {
+			ring_find_slots (r, &hv[i], m, slot);
+			for (j = 0; j < m; j ++)
+				out[i + j] = r->nodes[r->idx[slot[j]]];
+			if (unlikely (r->vhits)) {
+				for (j = 0; j < m; j ++)
+					if (r->vhits[slot[j]])
+						hits_inc (r->vhits[slot[j]]);
+			}
+		} else {
+			/* Empty ring. */
+			for (j = 0; j < m; j ++)
+				out[i + j] = NULL;
+		}
+
+		for (j = 0; j < m; j ++) {
+			if (likely (out[i + j]))
+				N_HITS_INC(out[i + j]);
+		}
+	}
+
+	epoch_read_unlock ();
+}
+
+/** Lookup physical nodes for $n keys at once. $lens may be NULL for
+	NUL-terminated keys. $out[i] is the node of $keys[i]. */
+void node_lookup_batch (struct chash_root *ch, char **keys, size_t *lens, int n, struct node_t **out)
+{
+	int i, j, m;
+	ring_key_t hv[RING_BATCH];
+
+	for (i = 0; i < n; i += RING_BATCH) {
+		m = MIN (RING_BATCH, n - i);
+
+		for (j = 0; j < m; j ++)
+			hv[j] = ch->hash_func (keys[i + j], lens ? lens[i + j] : strlen (keys[i + j]));
+
+		node_lookup_batch_hv (ch, hv, m, &out[i]);
+	}
+}
+
+/** Total hits of all physical nodes, merged from the shards. */
+uint64_t chash_hits (struct chash_root *ch)
+{
+	uint64_t hits = 0;
+	struct node_t *n1 = NULL, *p;
+
+	oryx_thread_mutex_lock (&ch->nhlock);
+
+	list_for_each_entry_safe(n1, p, &ch->node_head, node)
+		hits += N_HITS(n1);
+
+	oryx_thread_mutex_unlock (&ch->nhlock);
+
+	return hits;
+}
+
+/** Dump all physical node and statistics, hit ratios next to the exact owned share of the ring.*/
+void node_summary (struct chash_root *ch)
+{
+	int i = 0, exact;
+	struct node_t *n1 = NULL, *p;
+	uint64_t total = chash_hits (ch);
+	struct ring_balance_t b;
+
+	printf ("\n\n\nTotal %15d(%-5d vns) machines, %s engine\n", ch->total_ns, total_vns(ch), ch->engine->name);
+
+	/* Keep the nodes of the snapshot valid while printing. */
+	epoch_read_lock ();
+	exact = !chash_balance (ch, &b, RING_BALANCE_TOP);
+
+	printf ("%15s%16s%4s%15s%15s%15s\n", "MACHINE", "IPADDR", "VNS", "HIT", "RATIO", "OWNED");
+	oryx_thread_mutex_lock (&ch->nhlock);
+	
+	list_for_each_entry_safe(n1, p, &ch->node_head, node){
+		/* Snapshot nodes are in list order. */
+		while (exact && i < b.nns && b.nodes[i] != n1)
+			i ++;
+		printf ("%15s%16s%4d%15llu%15.2f%s", 
+					n1->idesc, n1->ipaddr, n1->valid_vns, (unsigned long long)N_HITS(n1),
+					total ? (float)N_HITS(n1)/total * 100 : 0, "%");
+		/* Jump and HRW have neither positions nor a table to measure the share with. */
+		if (likely (exact && i < b.nns))
+			printf ("%14.2f%s\n", b.owned[i] * 100, "%");
+		else
+			printf ("%15s\n", "-");
+	}
+
+	oryx_thread_mutex_unlock (&ch->nhlock);
+
+	if (likely (exact)) {
+		printf ("\n");
+		ring_balance_dump (&b);
+		ring_balance_free (&b);
+	}
+
+	epoch_read_unlock ();
+}
+
+/** Dump all physical node.*/
+void node_dump (struct chash_root *ch)
+{
+	printf ("\n\n===========Virtual Nodes (%d)============\n", total_vns(ch));
+	_vn_travel (ch, _vn_dump, NODE_FLG_CLASSFY_TRAVEL);
+}
+
+/** Physical node configuration.*/
+void node_set (struct node_t *n, char *desc, char *ipaddr, int replicas)
+{
+	memcpy ((void *)&n->idesc[0], desc, strlen(desc));
+	memcpy ((void *)&n->ipaddr[0], ipaddr, strlen(ipaddr));
+	n->flags = NODE_FLG_INITED;
+	n->replicas = replicas;
+	n->weight = 0;
+	INIT_LIST_HEAD (&n->node);
+}
+
+/** Weight a physical node before installing it, its replicas are then derived
+	from $weight (chash_root->weight_vns virtual nodes per 1.0). */
+void node_set_weight (struct node_t *n, double weight)
+{
+	n->weight = weight;
+}
+
+/** Clone $old to $new in one linear pass, with no hashing. Physical nodes are
+	cloned, virtual nodes are copied in key order with their physical_node
+	remapped to the clones, and vn_root is relinked as chash_build does.
+	Hit counters are not copied. $new is NULL if there is not enough memory. */
+void chcopy (struct chash_root **new, struct chash_root *old)
+{
+
+	int i = 0, nns = 0, nvns = 0;
+	struct chash_root *backup;
+	struct node_t *n1 = NULL, *p, **shadows;
+	struct vnode_t **vns, *vn, *vn1;
+	struct rb_node *rbn;
+
+	*new = NULL;
+
+	backup = chash_init (old->hash_algo);
+	if (unlikely (!backup))
+		return;
+
+	oryx_thread_mutex_lock (&old->wrlock);
+
+	backup->vn_hits = old->vn_hits;
+	backup->ring_layout = old->ring_layout;
+	backup->ring_bucket_bits = old->ring_bucket_bits;
+	backup->ring_replicas = old->ring_replicas;
+	backup->build_threads = old->build_threads;
+	backup->weight_vns = old->weight_vns;
+	backup->engine = old->engine;
+	backup->table_size = old->table_size;
+	backup->load_factor = old->load_factor;
+
+	list_for_each_entry_safe(n1, p, &old->node_head, node) {
+		nns ++;
+		nvns += n1->valid_vns;
+	}
+
+	shadows = (struct node_t **) malloc (sizeof (struct node_t *) * (nns + 1));
+	vns = (struct vnode_t **) malloc (sizeof (struct vnode_t *) * (nvns + 1));
+	if (unlikely (!shadows || !vns))
+		goto fail;
+
+	/* Index the originals, their clone is shadows[n1->id]. */
+	oryx_thread_mutex_lock (&backup->nhlock);
+	list_for_each_entry_safe(n1, p, &old->node_head, node) {
+		shadows[i] = _n_clone (n1);
+		if (unlikely (!shadows[i])) {
+			oryx_thread_mutex_unlock (&backup->nhlock);
+			goto fail;
+		}
+		_n_link (backup, shadows[i]);
+		n1->id = i ++;
+	}
+	oryx_thread_mutex_unlock (&backup->nhlock);
+
+	/* In-order travel of vn_root gives ascending keys. */
+	i = 0;
+	for (rbn = rb_first (&old->vn_root); rbn && i < nvns; rbn = rb_next (rbn)) {
+		vn1 = rb_entry (rbn, struct vnode_t, node);
+		n1 = shadows[((struct node_t *)vn1->physical_node)->id];
+		vn = _vn_alloc (n1, VN_KEY_I(vn1), vn1->index, vn1->videsc, backup->vn_hits);
+		if (unlikely (!vn))
+			goto fail;
+		N_VALID_VNS_INC(n1);
+		list_add_tail (&vn->vnode, &n1->vnode_head);
+		vns[i ++] = vn;
+	}
+
+	_vn_relink (backup, vns, i);
+	if (unlikely (ring_publish (backup)))
+		goto fail;
+
+	oryx_thread_mutex_unlock (&old->wrlock);
+
+	free (shadows);
+	free (vns);
+
+	*new = backup;
+	return;
+
+fail:
+	oryx_thread_mutex_unlock (&old->wrlock);
+	printf ("Can not alloc memory. \n");
+
+	/* Only vnodes on node lists have been allocated. */
+	list_for_each_entry_safe(n1, p, &backup->node_head, node) {
+		list_for_each_entry_safe(vn, vn1, &n1->vnode_head, vnode) {
+			free (vn->videsc);
+			free (vn->hits);
+			free (vn);
+		}
+		free (n1);
+	}
+	ring_free (backup->ring);
+	free (backup);
+	free (shadows);
+	free (vns);
+}
+
+/*
+  * Everything below is the demo & single thread benchmarks of vchash.
+  * Define CHASH_LIBRARY to leave them out, e.g. for vchash_bench.
+  */
+#ifndef CHASH_LIBRARY
+
+/** Generate $m keys for injection, the $i-th (from $base) one is "2.x.y.z". */
+static __oryx_always_inline__
+void _inject_keys_generate (int base, int m, uint32_t *intp, char keys[][32], char **kp)
+{
+	int i, j;
+
+	for (j = 0; j < m; j ++) {
+		i = base + j;
+		memset ((void *)&keys[j][0], 0, 32);
+		sprintf (keys[j], "2.%d.%d.%d", 
+			((i * next_rand_(intp)) % 255),
+			((i * next_rand_(intp)) % 255),
+			((i * next_rand_(intp)) % 255));
+		kp[j] = keys[j];
+	}
+}
+
+/** Count keys mapped to a different physical node in two clusters. */
+static __oryx_always_inline__
+int _inject_keys_compare (struct chash_root *ch, struct chash_root *chnew, char **kp, int m)
+{
+	int j, c = 0;
+	ring_key_t hv[INJECT_BATCH];
+	struct node_t *n[INJECT_BATCH], *n_backup[INJECT_BATCH];
+
+	for (j = 0; j < m; j ++)
+		hv[j] = ch->hash_func (kp[j], strlen (kp[j]));
+
+	node_lookup_batch_hv (ch, hv, m, n);
+	node_lookup_batch_hv (chnew, hv, m, n_backup);
+
+	for (j = 0; j < m; j ++) {
+		if (oryx_strcmp_native (n[j]->idesc, n_backup[j]->idesc))
+			c ++;
+	}
+
+	return c;
+}
+
+/** Print the exact fraction of the key space which changed owner from $o to $n,
+	the sampled changes above estimate it, and the migration plan. */
+static void _diff_summary (struct chash_root *o, struct chash_root *n)
+{
+	int narcs;
+	double moved = 0;
+	struct ring_arc_t *arcs;
+	struct migrate_plan_t *plan;
+
+	narcs = chash_diff (o, n, &arcs, &moved);
+	if (unlikely (narcs < 0)) {
+		/* Only rings of a ring engine have arcs to diff. */
+		if (!o->engine->lookup && !n->engine->lookup)
+			printf ("Can not alloc memory. \n");
+		printf ("\n");
+		return;
+	}
+
+	printf (" Exact   (%-8d arcs %-4.2f%s)\n", narcs, moved * 100, "%");
+	free (arcs);
+
+	plan = migrate_plan (o, n, MIGRATE_PER_NODE);
+	if (likely (plan)) {
+		printf (" Plan    (%-8d tasks %d pairs, %d rounds of at most %d per machine)\n",
+			plan->narcs, plan->npairs, plan->nrounds, MIGRATE_PER_NODE);
+		migrate_plan_free (plan);
+	}
+	printf ("\n");
+}
+
+void check_miss_while_add ()
+{
+
+	int i, m;
+	uint32_t intp = 0;
+	char keys[INJECT_BATCH][32];
+	char *kp[INJECT_BATCH];
+	struct chash_root *chnew = NULL, *ch = NULL;
+	char *colur = CONSOLE_PRINT_CLOR_LWHITE;
+	struct node_t *new = NULL;
+
+	chnew = ch_add;
+	chcopy (&ch, chnew);
+	
+	changes = 0;
+	
+	new = _n_new ();
+	if (likely (new)) {
+		node_install (ch, new);
+		printf ("\n\n\n\nTrying to add a node ... \"%s\", done, total_vns=%d\n", 
+			new->ipaddr, total_vns(ch));
+	}
+
+	for (i = 0; i < MAX_INJECT_DATA; i += m) {
+		m = MIN (INJECT_BATCH, MAX_INJECT_DATA - i);
+		_inject_keys_generate (i, m, &intp, keys, kp);
+		changes += _inject_keys_compare (ch, chnew, kp, m);
+	};
+
+	if (changes <= THRESHOLD_L1(MAX_INJECT_DATA))
+		colur = CONSOLE_PRINT_CLOR_LWHITE;
+	
+	if ((changes > THRESHOLD_L1(MAX_INJECT_DATA)) && (changes <= THRESHOLD_L2(MAX_INJECT_DATA)))
+		colur = CONSOLE_PRINT_CLOR_LYELLOW;
+
+	if (changes >= THRESHOLD_L2(MAX_INJECT_DATA))
+		colur = CONSOLE_PRINT_CLOR_LRED;
+	
+	printf ("\nAdding ...%18s (%s)\n Changes (%-8u%s%-4.2f%s"CONSOLE_PRINT_CLOR_FIN")\n", 
+		new->ipaddr, new->idesc, 
+		changes, colur, (float)changes/MAX_INJECT_DATA * 100, "%");
+	_diff_summary (chnew, ch);
+
+}
+
+void check_miss_while_rm ()
+{
+
+	int i, m;
+	uint32_t intp = 0;
+	char keys[INJECT_BATCH][32];
+	char *kp[INJECT_BATCH];
+	struct chash_root *chnew = NULL, *ch = NULL;
+	char *colur = CONSOLE_PRINT_CLOR_LWHITE;
+	struct node_t *n = NULL;
+	/* The last installed one, a jump engine renumbers the nodes after any other. */
+	struct node_t *removed_node = &backend_node[MAX_BACKEND_MACHINES - 1];
+
+	chnew = ch_del;
+	chcopy (&ch, chnew);
+	
+	changes = 0;
+	
+	n = node_remove (ch, removed_node->ipaddr);
+
+	printf ("\n\n\n\nTrying to remove a node ... \"%s\", done, total_vns=%d\n", 
+		n->idesc, total_vns(ch));
+
+	free (n);
+	
+	for (i = 0; i < MAX_INJECT_DATA; i += m) {
+		m = MIN (INJECT_BATCH, MAX_INJECT_DATA - i);
+		_inject_keys_generate (i, m, &intp, keys, kp);
+		changes += _inject_keys_compare (ch, chnew, kp, m);
 	};
 
 	if (changes <= THRESHOLD_L1(MAX_INJECT_DATA))
@@ -795,9 +1942,10 @@ void check_miss_while_rm ()
 	if (changes >= THRESHOLD_L2(MAX_INJECT_DATA))
 		colur = CONSOLE_PRINT_CLOR_LRED;
 	
-	printf ("\nRemoving ...%18s (%s)\n Changes (%-8u%s%-4.2f%s"CONSOLE_PRINT_CLOR_FIN")\n\n", 
+	printf ("\nRemoving ...%18s (%s)\n Changes (%-8u%s%-4.2f%s"CONSOLE_PRINT_CLOR_FIN")\n", 
 		removed_node->ipaddr, removed_node->idesc, 
 		changes, colur, (float)changes/MAX_INJECT_DATA * 100, "%");
+	_diff_summary (chnew, ch);
 
 }
 
@@ -805,12 +1953,11 @@ void check_miss_while_rm ()
 void lookup_handler ()
 {
 
-	int i = 0;
-	uint32_t hv;
+	int i = 0, m;
 	uint32_t intp = 0;
-	char key[32] = {0};
-	struct node_t *n = NULL;
-	struct vnode_t *vn = NULL;
+	char keys[INJECT_BATCH][32];
+	char *kp[INJECT_BATCH];
+	struct node_t *n[INJECT_BATCH];
 	struct chash_root *ch = ch_template;
 	
 	chcopy (&ch_add, ch);
@@ -821,24 +1968,10 @@ void lookup_handler ()
 	
 	FOREVER {
 
-		for (i = 0; i < MAX_INJECT_DATA; i ++) {
-			memset ((void *)&key[0], 0, 32);
-			sprintf (key, "2.%d.%d.%d", 
-				((i * next_rand_(&intp)) % 255),
-				((i * next_rand_(&intp)) % 255),
-				((i * next_rand_(&intp)) % 255));
-
-			hv = ch->hash_func (key, strlen (key));
-
-			vn = _vn_find_ring(ch, (void *)(uint32_t *)&hv);
-			if (likely(vn))
-				n = vn->physical_node;
-			
-			if (likely(n)) {
-				ch->total_hit_times ++;
-				N_HITS_INC(n);
-				//printf ("[%16s] is in node: [%16s]\n", key, n->idesc);
-			}
+		for (i = 0; i < MAX_INJECT_DATA; i += m) {
+			m = MIN (INJECT_BATCH, MAX_INJECT_DATA - i);
+			_inject_keys_generate (i, m, &intp, keys, kp);
+			node_lookup_batch (ch, kp, NULL, m, n);
 		};
 
 		node_summary (ch);
@@ -851,13 +1984,390 @@ void lookup_handler ()
 	
 }
 
-int main ()
+/** Nanoseconds of a monotonic clock. */
+static __oryx_always_inline__
+uint64_t _now_ns ()
 {
+	struct timespec ts;
 
-	int i = 0;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Lookup times for each ring layout in benchmark. */
+#define BENCH_LOOKUPS	10000000
+
+/** Ring layout benchmark, rbtree vs. flat array vs. S-tree vs. Eytzinger
+	at 16k, 160k and 1.6M virtual nodes.*/
+void ring_layout_bench ()
+{
+	int i, j, l;
+	uint32_t intp;
+	ring_key_t hv;
+	uint64_t s, sink = 0;
+	char key[32], machine[32];
+	struct node_t *nodes;
+	struct chash_root *ch;
+	static const int machines[] = {100, 1000, 10000};
+	static const int layouts[] = {RING_LAYOUT_FLAT, RING_LAYOUT_STREE, RING_LAYOUT_EYTZINGER};
+	int bits;
+	ring_key_t hvs[INJECT_BATCH];
+	int slots[INJECT_BATCH];
+
+	printf ("\n\n\nRing layout benchmark, %d lookups each, S-tree kernel %s (ns/lookup)\n",
+		BENCH_LOOKUPS, ring_search_isa);
+	printf ("%10s%12s%12s%12s%12s%12s%12s\n", "VNS", "RBTREE", "FLAT", "STREE", "EYTZINGER", "STREE_BATCH", "BUCKET");
+
+	for (j = 0; j < (int)(sizeof (machines) / sizeof (machines[0])); j ++) {
+
+		ch = chash_init (HASH_ALGO_DEFAULT);
+		nodes = (struct node_t *) malloc (sizeof (struct node_t) * machines[j]);
+		if (unlikely (!ch || !nodes)) {
+			printf ("Can not alloc memory. \n");
+			return;
+		}
+
+		memset (nodes, 0, sizeof (struct node_t) * machines[j]);
+		for (i = 0; i < machines[j]; i ++) {
+			sprintf (machine, "Machine_%d", i);
+			sprintf (key, "10.%d.%d.%d", (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+			node_set (&nodes[i], machine, key, NODE_DEFAULT_VNS);
+			_n_install (ch, &nodes[i]);
+		}
+
+		printf ("%10d", total_vns (ch));
+
+		intp = 0;
+		s = _now_ns ();
+		for (i = 0; i < BENCH_LOOKUPS; i ++) {
+			hv = next_rand_key_ (&intp);
+			sink += ((struct vnode_t *)_vn_find_ring (ch, (void *)&hv))->index;
+		}
+		printf ("%12.1f", (double)(_now_ns () - s) / BENCH_LOOKUPS);
+
+		for (l = 0; l < (int)(sizeof (layouts) / sizeof (layouts[0])); l ++) {
+			ch->ring_layout = layouts[l];
+			ring_publish (ch);
+
+			intp = 0;
+			s = _now_ns ();
+			for (i = 0; i < BENCH_LOOKUPS; i ++)
+				sink += ring_find_slot (ch->ring, next_rand_key_ (&intp));
+			printf ("%12.1f", (double)(_now_ns () - s) / BENCH_LOOKUPS);
+		}
+
+		/* Interleaved S-tree searches, INJECT_BATCH at once */
+		ch->ring_layout = RING_LAYOUT_STREE;
+		ring_publish (ch);
+
+		intp = 0;
+		s = _now_ns ();
+		for (i = 0; i < BENCH_LOOKUPS; i += INJECT_BATCH) {
+			for (l = 0; l < INJECT_BATCH; l ++)
+				hvs[l] = next_rand_key_ (&intp);
+			ring_find_slots (ch->ring, hvs, INJECT_BATCH, slots);
+			sink += slots[0];
+		}
+		printf ("%12.1f", (double)(_now_ns () - s) / BENCH_LOOKUPS);
+
+		/* Prefix buckets, k = log2(total vns) */
+		for (bits = 0; (1 << bits) < total_vns (ch); bits ++);
+		ch->ring_bucket_bits = bits;
+		ring_publish (ch);
+
+		intp = 0;
+		s = _now_ns ();
+		for (i = 0; i < BENCH_LOOKUPS; i ++)
+			sink += ring_find_slot (ch->ring, next_rand_key_ (&intp));
+		printf ("%9.1f(%d)", (double)(_now_ns () - s) / BENCH_LOOKUPS, bits);
+		printf ("\n");
+
+		_vn_destroy (ch);
+		ring_free (ch->ring);
+		free (nodes);
+		free (ch);
+	}
+
+	/* Keep lookups from being optimized out. */
+	if (sink == 1)
+		printf ("\n");
+}
+
+/** Keys injected by the hash algorithms benchmark for the distribution test. */
+#define BENCH_HASH_KEYS	1000000
+
+/** Spread of BENCH_HASH_KEYS keys over MAX_BACKEND_MACHINES machines with NODE_DEFAULT_VNS
+	virtual nodes each, hashed with $algo and placed by $engine, as the most hit machine
+	over the average, and the standard deviation of hits over the average in $stddev.
+	Returns a negative value if out of memory. */
+static double _hash_algo_spread (int algo, const struct chash_engine_t *engine, double *stddev)
+{
+	int i, m;
+	uint32_t intp = 0;
+	uint64_t hits;
+	double avg, var = 0, max = 0;
+	char keys[INJECT_BATCH][32], machine[32], key[32];
+	char *kp[INJECT_BATCH];
+	struct node_t *out[INJECT_BATCH];
+	struct node_t *nodes, *n1, *p;
+	struct chash_root *ch;
+
+	ch = chash_init (algo);
+	nodes = (struct node_t *) malloc (sizeof (struct node_t) * MAX_BACKEND_MACHINES);
+	if (unlikely (!ch || !nodes)) {
+		printf ("Can not alloc memory. \n");
+		free (nodes);
+		return -1;
+	}
+
+	/* The engine goes before any node is installed. */
+	ch->engine = engine;
+	memset (nodes, 0, sizeof (struct node_t) * MAX_BACKEND_MACHINES);
+	for (i = 0; i < MAX_BACKEND_MACHINES; i ++) {
+		sprintf (machine, "Machine_%d", i);
+		sprintf (key, "10.0.%d.%d", (i >> 8) & 0xFF, i & 0xFF);
+		node_set (&nodes[i], machine, key, NODE_DEFAULT_VNS);
+		_n_install (ch, &nodes[i]);
+	}
+	ring_publish (ch);
+
+	for (i = 0; i < BENCH_HASH_KEYS; i += m) {
+		m = MIN (INJECT_BATCH, BENCH_HASH_KEYS - i);
+		_inject_keys_generate (i, m, &intp, keys, kp);
+		node_lookup_batch (ch, kp, NULL, m, out);
+	}
+
+	avg = (double)chash_hits (ch) / ch->total_ns;
+	list_for_each_entry_safe (n1, p, &ch->node_head, node) {
+		hits = N_HITS(n1);
+		var += ((double)hits - avg) * ((double)hits - avg);
+		max = MAX (max, (double)hits);
+	}
+	*stddev = sqrt (var / ch->total_ns) / avg;
+
+	_vn_destroy (ch);
+	ring_free (ch->ring);
+	free (nodes);
+	free (ch);
+
+	return max / avg;
+}
+
+/** Hash algorithms benchmark, throughput on 16 bytes keys and balance of
+	MAX_BACKEND_MACHINES nodes with NODE_DEFAULT_VNS virtual nodes each, on the
+	ring and on a Maglev table whose multiply-shift index needs hash values of full width.*/
+void hash_algo_bench ()
+{
+	int a, i;
+	uint32_t intp;
+	ring_key_t sink = 0;
+	uint64_t s;
+	double ns, max, dev, mmax, mdev;
+	char keys[INJECT_BATCH][32];
+	hash_fun_ptr fn;
+
+	printf ("\n\n\nHash algorithms benchmark, %d machines, %d keys\n",
+		MAX_BACKEND_MACHINES, BENCH_HASH_KEYS);
+	printf ("%10s%12s%12s%12s%12s%12s%12s\n", "ALGO", "NS/HASH", "MB/S", "MAX/AVG", "STDDEV",
+		"MAGLEV MAX", "STDDEV");
+
+	for (a = 0; a < HASH_ALGO_MAX; a ++) {
+
+		fn = hash_algo_func (a);
+
+		/* Throughput */
+		intp = 0;
+		for (i = 0; i < INJECT_BATCH; i ++)
+			sprintf (keys[i], "%015u", next_rand_ (&intp));
+
+		s = _now_ns ();
+		for (i = 0; i < BENCH_LOOKUPS; i ++)
+			sink += fn (keys[i % INJECT_BATCH], 15);
+		ns = (double)(_now_ns () - s) / BENCH_LOOKUPS;
+
+		/* Distribution, a root per engine. */
+		max = _hash_algo_spread (a, &chash_engine_ring, &dev);
+		mmax = _hash_algo_spread (a, &chash_engine_maglev, &mdev);
+		if (unlikely (max < 0 || mmax < 0))
+			return;
+
+		printf ("%10s%12.1f%12.1f%12.3f%11.2f%s%12.3f%11.2f%s\n", hash_algo_name (a),
+			ns, 15 / ns * 1000, max, dev * 100, "%", mmax, mdev * 100, "%");
+	}
+
+	/* Keep hashes from being optimized out. */
+	if (sink == 1)
+		printf ("\n");
+}
+
+/** Engines of the demo & the engines benchmark. */
+static const struct chash_engine_t *engines[] = {&chash_engine_ring, &chash_engine_jump,
+								&chash_engine_maglev, &chash_engine_hrw};
+
+/** Engines benchmark, node_lookup_hv latency of each engine at cache cluster sizes,
+	NODE_DEFAULT_VNS virtual nodes per machine for the ring.*/
+void engine_bench ()
+{
+	int e, i, j;
+	uint32_t intp;
+	uint64_t s, sink = 0;
+	char key[32], machine[32];
+	struct node_t *nodes;
+	struct chash_root *ch;
+	static const int machines[] = {8, 16, 32, 64, 256};
+
+	printf ("\n\n\nEngines benchmark, %d lookups each, HRW kernel %s (ns/lookup)\n",
+		BENCH_LOOKUPS, hrw_isa);
+	printf ("%10s", "MACHINES");
+	for (e = 0; e < (int)(sizeof (engines) / sizeof (engines[0])); e ++)
+		printf ("%12s", engines[e]->name);
+	printf ("\n");
+
+	for (j = 0; j < (int)(sizeof (machines) / sizeof (machines[0])); j ++) {
+
+		printf ("%10d", machines[j]);
+
+		for (e = 0; e < (int)(sizeof (engines) / sizeof (engines[0])); e ++) {
+
+			ch = chash_init (HASH_ALGO_DEFAULT);
+			nodes = (struct node_t *) malloc (sizeof (struct node_t) * machines[j]);
+			if (unlikely (!ch || !nodes)) {
+				printf ("Can not alloc memory. \n");
+				return;
+			}
+
+			ch->engine = engines[e];
+			memset (nodes, 0, sizeof (struct node_t) * machines[j]);
+			for (i = 0; i < machines[j]; i ++) {
+				sprintf (machine, "Machine_%d", i);
+				sprintf (key, "10.0.%d.%d", (i >> 8) & 0xFF, i & 0xFF);
+				node_set (&nodes[i], machine, key, NODE_DEFAULT_VNS);
+				_n_install (ch, &nodes[i]);
+			}
+			ring_publish (ch);
+
+			intp = 0;
+			s = _now_ns ();
+			for (i = 0; i < BENCH_LOOKUPS; i ++)
+				sink += node_lookup_hv (ch, next_rand_key_ (&intp))->id;
+			printf ("%12.1f", (double)(_now_ns () - s) / BENCH_LOOKUPS);
+
+			_vn_destroy (ch);
+			ring_free (ch->ring);
+			free (nodes);
+			free (ch);
+		}
+		printf ("\n");
+	}
+
+	/* Keep lookups from being optimized out. */
+	if (sink == 1)
+		printf ("\n");
+}
+
+/** In-flight requests of the bounded load benchmark, one in 4 is for one of BENCH_HOT_KEYS keys. */
+#define BENCH_INFLIGHT	100000
+#define BENCH_HOT_KEYS	8
+
+/** Bounded load load factor of the bounded load benchmark. */
+#define BENCH_LOAD_FACTOR	1.25
+
+/** Bounded load benchmark, the most loaded of MAX_BACKEND_MACHINES machines over the
+	average with a few hot keys, unbounded and with a BENCH_LOAD_FACTOR cap.*/
+void bounded_load_bench ()
+{
+	int e, c, i;
+	uint32_t intp;
+	int64_t max;
+	char key[32], machine[32];
+	ring_key_t hot[BENCH_HOT_KEYS], hv;
+	struct node_t *nodes, *n;
+	struct chash_root *ch;
+	static const double factors[] = {0, BENCH_LOAD_FACTOR};
+
+	printf ("\n\n\nBounded load benchmark, %d machines, %d requests in flight, one in 4 for %d hot keys (max/avg)\n",
+		MAX_BACKEND_MACHINES, BENCH_INFLIGHT, BENCH_HOT_KEYS);
+	printf ("%10s%12s%9s%.2f\n", "ENGINE", "UNBOUNDED", "C=", BENCH_LOAD_FACTOR);
+
+	for (e = 0; e < (int)(sizeof (engines) / sizeof (engines[0])); e ++) {
+
+		printf ("%10s", engines[e]->name);
+
+		for (c = 0; c < (int)(sizeof (factors) / sizeof (factors[0])); c ++) {
+
+			ch = chash_init (HASH_ALGO_DEFAULT);
+			nodes = (struct node_t *) malloc (sizeof (struct node_t) * MAX_BACKEND_MACHINES);
+			if (unlikely (!ch || !nodes)) {
+				printf ("Can not alloc memory. \n");
+				return;
+			}
+
+			ch->engine = engines[e];
+			ch->load_factor = factors[c];
+			memset (nodes, 0, sizeof (struct node_t) * MAX_BACKEND_MACHINES);
+			for (i = 0; i < MAX_BACKEND_MACHINES; i ++) {
+				sprintf (machine, "Machine_%d", i);
+				sprintf (key, "10.0.%d.%d", (i >> 8) & 0xFF, i & 0xFF);
+				node_set (&nodes[i], machine, key, NODE_DEFAULT_VNS);
+				_n_install (ch, &nodes[i]);
+			}
+			ring_publish (ch);
+
+			intp = 0;
+			for (i = 0; i < BENCH_HOT_KEYS; i ++)
+				hot[i] = next_rand_key_ (&intp);
+
+			for (i = 0; i < BENCH_INFLIGHT; i ++) {
+				hv = (i & 3) ? next_rand_key_ (&intp) : hot[(i >> 2) % BENCH_HOT_KEYS];
+				n = node_acquire_hv (ch, hv);
+				if (unlikely (!n))
+					break;
+			}
+
+			max = 0;
+			for (i = 0; i < MAX_BACKEND_MACHINES; i ++)
+				max = MAX (max, nodes[i].load);
+			printf ("%12.3f", (double)max * MAX_BACKEND_MACHINES / BENCH_INFLIGHT);
+
+			_vn_destroy (ch);
+			ring_free (ch->ring);
+			free (nodes);
+			free (ch);
+		}
+		printf ("\n");
+	}
+}
+
+int main (int argc, char **argv)
+{
+
+	int i = 0, e, opt;
+	struct node_t *shadows[MAX_BACKEND_MACHINES];
+
+	while ((opt = getopt (argc, argv, "lHEB")) != -1) {
+		switch (opt) {
+		case 'l':
+			ring_layout_bench ();
+			return 0;
+		case 'H':
+			hash_algo_bench ();
+			return 0;
+		case 'E':
+			engine_bench ();
+			return 0;
+		case 'B':
+			bounded_load_bench ();
+			return 0;
+		default:
+			printf ("Usage: %s [-l] [-H] [-E] [-B]\n"
+				"    -l    Ring layout benchmark\n"
+				"    -H    Hash algorithms benchmark\n"
+				"    -E    Engines benchmark\n"
+				"    -B    Bounded load benchmark\n", argv[0]);
+			return -1;
+		}
+	}
 
-	ch_template = chash_init();
-	
 	for (i = 0; i < MAX_BACKEND_MACHINES; i++) {
 		char key [32];
 		char machine[32];
@@ -866,13 +2376,22 @@ int main ()
 		node_set (&backend_node[i], machine, key, 160);
 	}
 
-	for (i = 0; i < MAX_BACKEND_MACHINES; i ++) {
-		struct node_t *shadow;
-		shadow = _n_clone (&backend_node[i]);
-		node_install (ch_template, shadow);
+	/* Same machines and keys against each engine. */
+	for (e = 0; e < (int)(sizeof (engines) / sizeof (engines[0])); e ++) {
+
+		printf ("\n\n\n===========%s engine============\n", engines[e]->name);
+
+		ch_template = chash_init (HASH_ALGO_DEFAULT);
+		ch_template->engine = engines[e];
+
+		for (i = 0; i < MAX_BACKEND_MACHINES; i ++)
+			shadows[i] = _n_clone (&backend_node[i]);
+		chash_build (ch_template, shadows, MAX_BACKEND_MACHINES);
+
+		lookup_handler ();
 	}
-	
-	lookup_handler ();
 
 	return 0;
 }
+
+#endif /* CHASH_LIBRARY */
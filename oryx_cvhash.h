@@ -16,6 +16,88 @@
 
 #define NODE_DEFAULT_VNS	160
 
+/** Default entries of a Maglev lookup table, a prime. A larger one such as 655373
+	gets closer to an even share, at 4 bytes an entry. */
+#define MAGLEV_TABLE_SIZE	65537
+
+/** Upper limit of chash_root->table_size. */
+#define MAGLEV_TABLE_SIZE_MAX	(1 << 24)
+
+/** Upper limit of nodes returned by node_lookup_replicas. */
+#define NODE_REPLICAS_MAX	16
+
+/** Default chash_root->ring_replicas, a replica set of 3 is the common case. */
+#define NODE_REPLICAS_DEFAULT	3
+
+/*
+  * Ring key space.
+  * Positions of virtual nodes and hash values of keys are 32 bit by default.
+  * Build with CHASH_RING64 defined (make RING64=1) for a 64 bit ring, so that
+  * clusters with thousands of nodes keep all their virtual nodes, a 32 bit ring
+  * has colliding positions once it holds about 2^16 virtual nodes.
+  */
+#ifdef CHASH_RING64
+typedef uint64_t ring_key_t;
+#else
+typedef uint32_t ring_key_t;
+#endif
+
+#define RING_KEY_BITS	(sizeof (ring_key_t) * 8)
+
+/** Count of hit counter shards. Reader threads owning one of the first
+	HITS_SHARDS - 1 epoch slots count into their own shard with plain stores,
+	other threads share the last one with atomic adds. */
+#define HITS_SHARDS	16
+
+/** uint64_t per cache line, shards are a cache line apart. */
+#define HITS_STRIDE	8
+
+/*
+  * Hit counter structure definnition.
+  * One 64 bit counter per shard, each on its own cache line, summed on demand.
+  */
+struct hits_t {
+	uint64_t v[HITS_SHARDS * HITS_STRIDE];
+};
+
+extern __thread int epoch_id;	/** Epoch slot of this thread, -1 if none, see oryx_cvhash_epoch.c. */
+
+/** Count a hit in the shard of this thread. */
+static __oryx_always_inline__
+void hits_inc (struct hits_t *h)
+{
+	uint64_t *c;
+
+	if (likely ((unsigned int)epoch_id < HITS_SHARDS - 1)) {
+		/* Single writer, a relaxed load & store is a plain add. */
+		c = &h->v[epoch_id * HITS_STRIDE];
+		__atomic_store_n (c, __atomic_load_n (c, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+	} else
+		__atomic_fetch_add (&h->v[(HITS_SHARDS - 1) * HITS_STRIDE], 1, __ATOMIC_RELAXED);
+}
+
+/** Sum of all shards. */
+static __oryx_always_inline__
+uint64_t hits_sum (struct hits_t *h)
+{
+	int i;
+	uint64_t sum = 0;
+
+	for (i = 0; i < HITS_SHARDS; i ++)
+		sum += __atomic_load_n (&h->v[i * HITS_STRIDE], __ATOMIC_RELAXED);
+
+	return sum;
+}
+
+static __oryx_always_inline__
+void hits_reset (struct hits_t *h)
+{
+	int i;
+
+	for (i = 0; i < HITS_SHARDS; i ++)
+		__atomic_store_n (&h->v[i * HITS_STRIDE], 0, __ATOMIC_RELAXED);
+}
+
 /*
   * Real Instance Node structure definnition.
   * Real instance node is set up in a cluster for data store and proccess..
@@ -29,17 +111,28 @@ struct node_t {
 						
 	int replicas;	/** Pre-allocated virtual node count for this real node instance. */	
 
+	double weight;	/** Relative capacity, e.g. 1.0, 1.5, 2.0. If set (greater than 0), replicas
+						is derived from it on install, see chash_root->weight_vns. */
+
 	int valid_vns;	/** Validate virtual nodes within this real node instance. */
 	
 	int flags;		/** State & runtime options. */
 
 	struct list_head node;
 
-	uint32_t hits;	/** For hit testing. */
+	struct list_head vnode_head;	/** Virtual nodes of this instance, so that node_remove
+										erases them without hashing their names again. */
+
+	int id;		/** Compact index within the current ring snapshot. */
+
+	struct hits_t hits;	/** For hit testing, sharded per reader thread. */
+
+	int64_t load;	/** In-flight requests, taken by node_acquire and given back by node_release. */
 };
 
-#define N_HITS_INC(n) ((n)->hits ++)
-#define N_HITS(n) ((n)->hits)
+#define N_HITS_INC(n) hits_inc (&(n)->hits)
+#define N_HITS(n) hits_sum (&(n)->hits)
+#define N_HITS_RESET(n) hits_reset (&(n)->hits)
 #define N_VALID_VNS(n) ((n)->valid_vns)
 #define N_VALID_VNS_INC(n) ((n)->valid_vns ++)
 
@@ -52,7 +145,7 @@ struct vnode_t {
 	union {
 	    const char *s;	/** A character pointer when the key's format is a string.*/
 	    intptr_t p;		/** A pointer when the key's format is a address */
-	    uint32_t i;		/** A specified unsigned integer key, 
+	    ring_key_t i;		/** A specified unsigned integer key, 
 	    					always used with hash function. */
 	} key;		/** The key for this vnode */
 
@@ -63,16 +156,19 @@ struct vnode_t {
 	struct rb_node node;	/** We are trying to store virtual node on a red black tree. 
 							Red-Black tree is always used for node-finding, 
 							fast-querying etc. */
-	uint32_t hits;	/** For hit testing. */
+
+	struct list_head vnode;	/** Link in vnode_head of ITS real instance node. */
+	struct hits_t *hits;	/** For hit testing, only allocated if chash_root->vn_hits is set. */
 };
 
-#define VN_HITS_INC(vn) ((vn)->hits ++)
+#define VN_HITS_INC(vn) do { if ((vn)->hits) hits_inc ((vn)->hits); } while (0)
+#define VN_HITS(vn) ((vn)->hits ? hits_sum ((vn)->hits) : 0)
 #define VN_KEY_P(vn) (vn->key.p)
 #define VN_KEY_S(vn) (vn->key.s)
 #define VN_KEY_I(vn) (vn->key.i)
 
 
-typedef uint32_t (*hash_fun_ptr)(char *, size_t);
+typedef ring_key_t (*hash_fun_ptr)(char *, size_t);
 
 /*
   * Consistent Hash Root structure definnition.
@@ -80,36 +176,179 @@ typedef uint32_t (*hash_fun_ptr)(char *, size_t);
   */
 struct chash_root {
 	
-	struct rb_root vn_root;	/** Virtual node RB root, we do not have a IPC lock for rbtree. */
+	struct rb_root vn_root;	/** Virtual node RB root, only writers holding wrlock touch it. */
 
-	struct rb_node *vn_max;	/** Maximum key value for current 32 bit key mapping region.
+	struct rb_node *vn_max;	/** Maximum key value for current key mapping region.
 								Return the real node instance that has a  maximum key value if needed.
 								It's one of the query policies when we can not locate a real node instance 
 								with a known key by consistent hash algorithms.*/
 
-	struct rb_node *vn_min;	/** Miniimum key value for current 32 bit key mapping region. 
+	struct rb_node *vn_min;	/** Miniimum key value for current key mapping region. 
 								Return the real node instance that has a  minimum key value if needed.
 								It's one of the query policies when we can not locate a real node instance 
 								with a known key by consistent hash algorithms.*/
 	
 	int total_ns;				/** Total count of real node instance. */
-	int total_hit_times;
+
+	int vn_hits;		/** Count hits per virtual node too, for virtual nodes installed while set.
+							Costs sizeof (struct hits_t), 1KB, per virtual node. */
+
+	int hash_algo;		/** Hash algorithm (HASH_ALGO_XXX) selected by chash_init. */
 
 	hash_fun_ptr hash_func;	/** Hash algorithms function. */
 
 	struct list_head node_head;	/** List stored all real node instance. */
 	oryx_thread_mutex_t  nhlock;	/** Node head lock */
 
+	struct ring_t *ring;	/** Flat read-only snapshot of vn_root used by node_lookup.
+								Republished by node_install and node_remove with an atomic swap,
+								readers never lock and never walk vn_root. */
+
+	oryx_thread_mutex_t wrlock;	/** Serializes writers (node_install, node_remove) of vn_root and ring. */
+
+	int ring_layout;	/** Search layout (RING_LAYOUT_XXX) of the snapshot. */
+
+	int ring_bucket_bits;	/** k, put a 2^k entries prefix bucket index in front of the ring, 0 to disable.
+								Memory is 4 * 2^k bytes, log2(total vns) is a good choice. */
+
+	int ring_replicas;	/** k, keep the next k distinct real node instances of every ring slot in the
+							snapshot, so that node_lookup_replicas of up to k nodes is a single search.
+							Memory is 4 * k bytes per virtual node, NODE_REPLICAS_DEFAULT by default,
+							0 to walk the ring instead. */
+
+	int weight_vns;		/** Virtual nodes of a weight 1.0 node, NODE_DEFAULT_VNS by default.
+							Weights are rounded to a multiple of 1 / weight_vns. */
+
+	int build_threads;	/** Threads hashing virtual nodes in chash_build, 0 or 1 for the caller only. */
+
+	const struct chash_engine_t *engine;	/** Placement of keys (&chash_engine_ring by default).
+												Must be set before any node is installed. */
+
+	double load_factor;	/** Bounded load cap c of node_acquire, e.g. 1.25. A node already holding
+							ceil (c * average) in-flight requests is passed over, 0 for no cap. */
+
+	int64_t load_total;	/** In-flight requests of all nodes, see node_acquire & node_release. */
+
+	int table_size;		/** Entries of the lookup table of a table engine (Maglev), rounded up to a prime,
+							MAGLEV_TABLE_SIZE if 0. Memory is 4 bytes per entry per snapshot. */
+
+};
+
+/*
+  * Consistent hash engine structure definnition.
+  * How keys are placed onto real node instances, behind the same node_install,
+  * node_remove and node_lookup. The ring engine places virtual nodes on vn_root,
+  * other engines place keys by the compact node index of the ring snapshot only.
+  */
+struct chash_engine_t {
+
+	const char *name;
+
+	void (*vn_grow) (struct chash_root *ch, struct node_t *n, int from, int to);	/** Install the virtual
+								nodes $from .. $to - 1 of $n, NULL if the engine has no virtual nodes. */
+
+	void (*vn_shrink) (struct chash_root *ch, struct node_t *n, int from);	/** Erase the virtual nodes
+								of $n whose index is $from or greater. */
+
+	int (*lookup) (const struct ring_t *r, ring_key_t hv);	/** Compact index of the node of $hv within
+								the snapshot $r which has nodes, NULL for the ring which is searched inline. */
+
+	int (*lookup_replicas) (const struct ring_t *r, ring_key_t hv, int n, int *idx);	/** Compact indexes
+								of up to $n distinct nodes of $hv, owner first, returns their count.
+								NULL if the engine only knows the owner. */
+
+	int (*build) (struct chash_root *ch, struct ring_t *r);	/** Build the lookup state of the snapshot $r
+								from its nodes, NULL if there is none. Returns 0, or -1 if out of memory. */
+
+	int weighted;	/** Placement follows node_t.replicas, so nodes can be weighted and reweighted. */
+};
+
+/** Engines, see oryx_cvhash.c, oryx_cvhash_jump.c, oryx_cvhash_maglev.c and oryx_cvhash_hrw.c. */
+extern const struct chash_engine_t chash_engine_ring;
+extern const struct chash_engine_t chash_engine_jump;
+extern const struct chash_engine_t chash_engine_maglev;
+extern const struct chash_engine_t chash_engine_hrw;
+
+/** Scoring kernel of the HRW engine selected at startup (avx2 or scalar). */
+extern const char *hrw_isa;
+
+/** Staged membership changes of a chash_txn_t. */
+enum {
+	CHASH_TXN_ADD,
+	CHASH_TXN_REMOVE,
+	CHASH_TXN_WEIGHT,
+};
+
+/*
+  * Transaction operation structure definnition.
+  */
+struct chash_txn_op_t {
+
+	int op;		/** CHASH_TXN_XXX. */
+
+	struct node_t *n;	/** Node to add, or the node removed or reweighted once applied. */
+
+	char ipaddr[32];	/** Node to remove or reweight. */
+
+	double weight;	/** New weight of a reweighted node. */
+
+	/* Undo state, so that a commit whose ring can not be published is rolled back. */
+
+	int applied;
+
+	struct list_head *prev;	/** List entry a removed node followed. */
+
+	double prev_weight;	/** Weight of a reweighted node before. */
+
+	int prev_replicas;	/** Replicas of an added or reweighted node before. */
+};
+
+/*
+  * Membership transaction structure definnition.
+  * Changes are staged without touching $ch, and applied by chash_txn_commit
+  * with a single ring publish, so that lookups see the ring before or after
+  * all of them, never one in between.
+  */
+struct chash_txn_t {
+
+	struct chash_root *ch;
+
+	struct chash_txn_op_t *ops;	/** Staged changes, applied in order. */
+
+	int nops;
 
+	int size;		/** Capacity of ops. */
 };
 
 #define VN_DEFAULT(ch,default)\
 	if (likely (ch) && likely (ch->vn_min))\
 		default = rb_entry(ch->vn_min, struct vnode_t, node);
 	
+extern struct chash_root *chash_init (int algo);
+extern uint64_t chash_hits (struct chash_root *ch);
 extern struct node_t *node_lookup (struct chash_root *ch, char *key);
-extern void node_install (struct chash_root *ch, struct node_t *n);
+extern struct node_t *node_lookup_hv (struct chash_root *ch, ring_key_t hv);
+extern struct node_t *node_lookup_n (struct chash_root *ch, const void *key, size_t len);
+extern void node_lookup_batch (struct chash_root *ch, char **keys, size_t *lens, int n, struct node_t **out);
+extern void node_lookup_batch_hv (struct chash_root *ch, const ring_key_t *hv, int n, struct node_t **out);
+extern int node_lookup_replicas (struct chash_root *ch, char *key, int n, struct node_t **out);
+extern int node_lookup_replicas_hv (struct chash_root *ch, ring_key_t hv, int n, struct node_t **out);
+extern struct node_t *node_acquire (struct chash_root *ch, char *key);
+extern struct node_t *node_acquire_hv (struct chash_root *ch, ring_key_t hv);
+extern void node_release (struct chash_root *ch, struct node_t *n);
+extern int node_install (struct chash_root *ch, struct node_t *n);
+extern int chash_build (struct chash_root *ch, struct node_t **nodes, int n);
+extern void chcopy (struct chash_root **new, struct chash_root *old);
+extern struct chash_txn_t *chash_txn_begin (struct chash_root *ch);
+extern int chash_txn_add (struct chash_txn_t *txn, struct node_t *n);
+extern int chash_txn_remove (struct chash_txn_t *txn, char *nodekey);
+extern int chash_txn_set_weight (struct chash_txn_t *txn, char *nodekey, double weight);
+extern int chash_txn_commit (struct chash_txn_t *txn, struct node_t **removed);
+extern void chash_txn_abort (struct chash_txn_t *txn);
+extern struct node_t *node_remove (struct chash_root *ch, char *nodekey);
 extern void node_set (struct node_t *n, char *desc, char *ipaddr, int replicas);
+extern void node_set_weight (struct node_t *n, double weight);
+extern int node_reweight (struct chash_root *ch, char *nodekey, double weight);
 
 #endif
 
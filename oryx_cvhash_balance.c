@@ -0,0 +1,187 @@
+/*
+ *   oryx_cvhash_balance.c
+ *   Func: Exact ownership & balance analysis of a ring snapshot
+ *   Personal.Q
+ */
+
+#include "oryx.h"
+#include "oryx_rbtree.h"
+#include "oryx_list.h"
+#include "oryx_ipc.h"
+#include "oryx_cvhash.h"
+#include "oryx_cvhash_ring.h"
+#include "oryx_cvhash_epoch.h"
+#include "oryx_cvhash_balance.h"
+
+#include <math.h>
+
+static int _double_cmp (const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/** Offer span $s to the min-heap $h of the $k largest spans holding $n of them. */
+static void _top_offer (struct ring_span_t *h, int *n, int k, const struct ring_span_t *s)
+{
+	int i, c;
+
+	if (*n < k) {
+		/* Sift up */
+		for (i = (*n) ++; i && h[(i - 1) / 2].keys > s->keys; i = (i - 1) / 2)
+			h[i] = h[(i - 1) / 2];
+		h[i] = *s;
+		return;
+	}
+
+	if (!k || s->keys <= h[0].keys)
+		return;
+
+	/* Replace the smallest, sift down */
+	for (i = 0; (c = 2 * i + 1) < k; i = c) {
+		if (c + 1 < k && h[c + 1].keys < h[c].keys)
+			c ++;
+		if (h[c].keys >= s->keys)
+			break;
+		h[i] = h[c];
+	}
+	h[i] = *s;
+}
+
+static int _span_cmp (const void *a, const void *b)
+{
+	double x = ((const struct ring_span_t *)a)->keys, y = ((const struct ring_span_t *)b)->keys;
+
+	return (x < y) - (x > y);
+}
+
+/** Exact ownership of ring $r. Position pos[i] owns the keys pos[i - 1] + 1 .. pos[i],
+	and pos[0] (vn_min) also owns the wraparound arc above the last position.
+	The owned fraction of every node and the $ntop largest arcs are gathered in a
+	single O(V log ntop) pass, the summary statistics cost O(N log N) for N nodes.
+	A node of a lookup table (Maglev) owns the share of the table entries it holds,
+	there are no arcs. Returns 0, or -1 if out of memory or $r has neither positions
+	nor a table (jump). $b must be released with ring_balance_free. */
+int ring_balance (const struct ring_t *r, struct ring_balance_t *b, int ntop)
+{
+	int i;
+	double space = ldexp (1.0, RING_KEY_BITS), avg, var = 0, g = 0, sum = 0;
+	double *sorted = NULL;
+	struct ring_span_t s;
+
+	memset (b, 0, sizeof (struct ring_balance_t));
+	if (unlikely (r->engine->lookup && !r->table))
+		return -1;
+
+	ntop = MIN (MAX (ntop, 0), r->nvns);
+
+	b->nns = r->nns;
+	b->nvns = r->nvns;
+	b->nodes = (struct node_t **) malloc (sizeof (struct node_t *) * (r->nns + 1));
+	b->owned = (double *) malloc (sizeof (double) * (r->nns + 1));
+	b->top = (struct ring_span_t *) malloc (sizeof (struct ring_span_t) * (ntop + 1));
+	sorted = (double *) malloc (sizeof (double) * (r->nns + 1));
+	if (unlikely (!b->nodes || !b->owned || !b->top || !sorted)) {
+		free (sorted);
+		ring_balance_free (b);
+		return -1;
+	}
+
+	for (i = 0; i < r->nns; i ++) {
+		b->nodes[i] = r->nodes[i];
+		b->owned[i] = 0;
+	}
+
+	for (i = 0; i < r->nvns; i ++) {
+		if (i) {
+			s.start = r->pos[i - 1] + 1;
+			s.keys = (double)(r->pos[i] - r->pos[i - 1]);
+		} else {
+			/* Wraparound, the whole space if there is a single position. */
+			s.start = r->pos[r->nvns - 1] + 1;
+			s.keys = (r->nvns == 1) ? space : (double)(ring_key_t)(r->pos[0] - r->pos[r->nvns - 1]);
+		}
+		s.end = r->pos[i];
+		s.node = r->nodes[r->idx[i]];
+
+		b->owned[r->idx[i]] += s.keys;
+		_top_offer (b->top, &b->ntop, ntop, &s);
+	}
+
+	for (i = 0; r->nns && i < r->table_size; i ++)
+		b->owned[r->table[i]] += space / r->table_size;
+
+	qsort (b->top, b->ntop, sizeof (struct ring_span_t), _span_cmp);
+
+	if (!r->nns) {
+		free (sorted);
+		return 0;
+	}
+
+	for (i = 0; i < r->nns; i ++) {
+		b->owned[i] /= space;
+		sorted[i] = b->owned[i];
+		sum += sorted[i];
+	}
+
+	qsort (sorted, r->nns, sizeof (double), _double_cmp);
+
+	avg = sum / r->nns;
+	for (i = 0; i < r->nns; i ++) {
+		var += (sorted[i] - avg) * (sorted[i] - avg);
+		/* G = sum (2i - n + 1) x_i / (n sum x), i from 0 over ascending x. */
+		g += (2.0 * i - r->nns + 1) * sorted[i];
+	}
+
+	if (avg > 0) {
+		b->max_avg = sorted[r->nns - 1] / avg;
+		b->min_avg = sorted[0] / avg;
+		b->stddev = sqrt (var / r->nns) / avg;
+		b->gini = g / (r->nns * sum);
+	}
+
+	free (sorted);
+
+	return 0;
+}
+
+/** Exact ownership of the current ring of $ch, see ring_balance.
+	Nodes in $b are only guaranteed to stay valid within a read section
+	(epoch_read_lock) entered by the caller before this call. */
+int chash_balance (struct chash_root *ch, struct ring_balance_t *b, int ntop)
+{
+	int ret;
+
+	epoch_read_lock ();
+	ret = ring_balance (ring_deref (ch), b, ntop);
+	epoch_read_unlock ();
+
+	return ret;
+}
+
+void ring_balance_free (struct ring_balance_t *b)
+{
+	free (b->nodes);
+	free (b->owned);
+	free (b->top);
+	memset (b, 0, sizeof (struct ring_balance_t));
+}
+
+/** Dump the summary and the largest arcs of $b. */
+void ring_balance_dump (const struct ring_balance_t *b)
+{
+	int i;
+
+	printf ("Exact balance of %d machines (%d vns): max/avg %.3f, min/avg %.3f, stddev %.2f%s, gini %.4f\n",
+		b->nns, b->nvns, b->max_avg, b->min_avg, b->stddev * 100, "%", b->gini);
+
+	if (b->ntop)
+		printf ("%15s%16s%24s%24s%13s\n", "MACHINE", "IPADDR", "START", "END", "LARGEST ARCS");
+
+	for (i = 0; i < b->ntop; i ++)
+		printf ("%15s%16s%24llu%24llu%12.4f%s\n", b->top[i].node->idesc, b->top[i].node->ipaddr,
+			(unsigned long long)b->top[i].start, (unsigned long long)b->top[i].end,
+			b->top[i].keys / ldexp (1.0, RING_KEY_BITS) * 100, "%");
+}
+
@@ -0,0 +1,64 @@
+/*
+ *   oryx_cvhash_balance.h
+ *   Func: Exact ownership & balance analysis of a ring snapshot
+ *   Personal.Q
+ */
+
+
+#ifndef __ORYX_CVHASH_BALANCE_H__
+#define __ORYX_CVHASH_BALANCE_H__
+
+/** Largest arcs kept by default by chash_balance callers. */
+#define RING_BALANCE_TOP	8
+
+/*
+  * Ring span structure definnition.
+  * Keys start .. end (both inclusive) owned by $node. Only the wraparound span,
+  * owned by the first position (vn_min), has start greater than end.
+  */
+struct ring_span_t {
+
+	ring_key_t start;
+
+	ring_key_t end;
+
+	double keys;	/** Count of keys, as a double since a whole 64 bit space does not fit. */
+
+	struct node_t *node;
+};
+
+/*
+  * Ring balance structure definnition.
+  * Exact share of the key space owned by each real node instance of a ring,
+  * from the lengths of the arcs between consecutive positions.
+  */
+struct ring_balance_t {
+
+	int nns;		/** Count of real node instances (entries of nodes & owned). */
+
+	int nvns;		/** Count of virtual nodes. */
+
+	struct node_t **nodes;	/** Real node instances, in the compact index order of the ring. */
+
+	double *owned;	/** Parallel array, fraction of the key space owned by nodes[i]. */
+
+	double max_avg;	/** Largest owned fraction over the average one, 1 is perfect. */
+
+	double min_avg;	/** Smallest owned fraction over the average one. */
+
+	double stddev;	/** Standard deviation of owned fractions over the average one. */
+
+	double gini;	/** Gini coefficient of owned fractions, 0 is perfect, 1 - 1/nns is worst. */
+
+	struct ring_span_t *top;	/** Largest arcs, descending. */
+
+	int ntop;		/** Entries of top. */
+};
+
+extern int ring_balance (const struct ring_t *r, struct ring_balance_t *b, int ntop);
+extern int chash_balance (struct chash_root *ch, struct ring_balance_t *b, int ntop);
+extern void ring_balance_free (struct ring_balance_t *b);
+extern void ring_balance_dump (const struct ring_balance_t *b);
+
+#endif
+
@@ -0,0 +1,450 @@
+/*
+ *   oryx_cvhash_bench.c
+ *   Func: Multi-threaded lookup benchmark with CPU pinning (vchash_bench)
+ *   Personal.Q
+ */
+
+/* CPU_SET & sched_{get,set}affinity, before any system header. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+
+#include "oryx.h"
+#include "oryx_rbtree.h"
+#include "oryx_list.h"
+#include "oryx_ipc.h"
+#include "oryx_cvhash.h"
+#include "oryx_cvhash_hash.h"
+#include "oryx_cvhash_epoch.h"
+
+#include <pthread.h>
+
+/** Upper limit of benchmark threads. */
+#define BENCH_THREADS_MAX	256
+
+/** Distinct keys of each thread, looked up round robin. */
+#define BENCH_KEYS	65536
+
+/** One in 2^BENCH_SAMPLE_SHIFT lookups (or batches) is timed for the latency percentiles. */
+#define BENCH_SAMPLE_SHIFT	4
+
+/** Upper limit of keys looked up at once with -b. */
+#define BENCH_BATCH_MAX	256
+
+/*
+  * Benchmark configuration structure definnition.
+  */
+struct bench_conf_t {
+
+	int machines;	/** Count of real node instances installed. */
+
+	int vns;		/** Virtual nodes per real node instance. */
+
+	int threads;	/** Maximum count of threads, steps are 1, 2, 4 ... threads. */
+
+	int batch;		/** Keys per node_lookup_batch call, 0 for node_lookup_n. */
+
+	int algo;		/** HASH_ALGO_XXX. */
+
+	int churn_ms;	/** Remove & reinstall a node every churn_ms in a writer thread, 0 to disable. */
+
+	const struct chash_engine_t *engine;	/** chash_root->engine. */
+
+	uint64_t lookups;	/** Lookups per thread at each step. */
+};
+
+/*
+  * Benchmark thread structure definnition.
+  */
+struct bench_thread_t {
+
+	pthread_t tid;
+
+	int cpu;		/** CPU this thread is pinned to, -1 if pinning failed. */
+
+	struct chash_root *ch;
+
+	const struct bench_conf_t *conf;
+
+	pthread_barrier_t *barrier;
+
+	char (*keys)[32];	/** BENCH_KEYS keys, private to this thread. */
+
+	size_t *lens;
+
+	uint32_t *samples;	/** Latency samples in ns. */
+
+	uint64_t nsamples;
+
+	uint64_t ns;	/** Wall time of all lookups. */
+
+	uint64_t sink;	/** Keeps lookups from being optimized out. */
+
+	uint64_t changes;	/** Membership changes made by the churn thread. */
+};
+
+static volatile int bench_stop;
+
+/** Nanoseconds of a monotonic clock. */
+static __oryx_always_inline__
+uint64_t _now_ns ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** CPUs this process may run on, in ascending order, from its affinity mask so that
+	a cpuset or taskset is honored. Falls back to all online CPUs. Returns their count. */
+static int _allowed_cpus (int *cpus)
+{
+	int i, n = 0;
+	cpu_set_t set;
+
+	CPU_ZERO (&set);
+	if (sched_getaffinity (0, sizeof (set), &set)) {
+		n = MIN ((int)sysconf (_SC_NPROCESSORS_ONLN), CPU_SETSIZE);
+		for (i = 0; i < n; i ++)
+			cpus[i] = i;
+		return n;
+	}
+
+	for (i = 0; i < CPU_SETSIZE; i ++) {
+		if (CPU_ISSET (i, &set))
+			cpus[n ++] = i;
+	}
+
+	return n;
+}
+
+/** Pin the calling thread to $cpu. Returns 0 on success. */
+static int _pin_cpu (int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO (&set);
+	CPU_SET (cpu, &set);
+
+	return sched_setaffinity (0, sizeof (set), &set);
+}
+
+static int _u32_cmp (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/** The $p-th (0 .. 1) percentile of $n sorted samples. */
+static __oryx_always_inline__
+uint32_t _percentile (const uint32_t *samples, uint64_t n, double p)
+{
+	if (unlikely (!n))
+		return 0;
+
+	return samples[(uint64_t)(p * (n - 1))];
+}
+
+static void *bench_lookup_thread (void *arg)
+{
+	struct bench_thread_t *t = (struct bench_thread_t *)arg;
+	const struct bench_conf_t *conf = t->conf;
+	struct node_t *out[BENCH_BATCH_MAX];
+	char *kp[BENCH_BATCH_MAX];
+	uint64_t i, s, s0, step = conf->batch ? (uint64_t)conf->batch : 1;
+	int j, k = 0;
+
+	if (t->cpu >= 0 && _pin_cpu (t->cpu)) {
+		printf ("Can not pin a thread to CPU %d: %s\n", t->cpu, strerror (errno));
+		t->cpu = -1;
+	}
+
+	/* Warm up the thread's epoch slot and caches. */
+	for (j = 0; j < 1024; j ++)
+		node_lookup_n (t->ch, t->keys[j], t->lens[j]);
+
+	pthread_barrier_wait (t->barrier);
+
+	s0 = _now_ns ();
+
+	for (i = 0; i < conf->lookups; i += step) {
+
+		if (((i / step) & ((1 << BENCH_SAMPLE_SHIFT) - 1)) == 0) {
+			s = _now_ns ();
+			if (conf->batch) {
+				for (j = 0; j < conf->batch; j ++)
+					kp[j] = t->keys[(k + j) & (BENCH_KEYS - 1)];
+				node_lookup_batch (t->ch, kp, NULL, conf->batch, out);
+				t->sink += (uintptr_t)out[0];
+			} else
+				t->sink += (uintptr_t)node_lookup_n (t->ch, t->keys[k], t->lens[k]);
+			t->samples[t->nsamples ++] = (uint32_t)MIN (_now_ns () - s, UINT32_MAX);
+		} else {
+			if (conf->batch) {
+				for (j = 0; j < conf->batch; j ++)
+					kp[j] = t->keys[(k + j) & (BENCH_KEYS - 1)];
+				node_lookup_batch (t->ch, kp, NULL, conf->batch, out);
+				t->sink += (uintptr_t)out[0];
+			} else
+				t->sink += (uintptr_t)node_lookup_n (t->ch, t->keys[k], t->lens[k]);
+		}
+
+		k = (k + step) & (BENCH_KEYS - 1);
+	}
+
+	t->ns = _now_ns () - s0;
+
+	return NULL;
+}
+
+/** Membership churn, remove a node and install it again every $churn_ms. */
+static void *bench_churn_thread (void *arg)
+{
+	struct bench_thread_t *t = (struct bench_thread_t *)arg;
+	struct node_t *n, *shadow;
+	char ipaddr[32];
+	int i = 0;
+
+	while (!bench_stop) {
+		usleep (t->conf->churn_ms * 1000);
+
+		sprintf (ipaddr, "10.%d.%d.%d", (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+		n = node_remove (t->ch, ipaddr);
+		if (likely (n)) {
+			shadow = (struct node_t *) malloc (sizeof (struct node_t));
+			if (likely (shadow)) {
+				memset (shadow, 0, sizeof (struct node_t));
+				node_set (shadow, n->idesc, n->ipaddr, n->replicas);
+				/* Not linked anywhere if it was not installed. */
+				if (unlikely (node_install (t->ch, shadow)))
+					free (shadow);
+			}
+			free (n);
+		}
+
+		i = (i + 1) % t->conf->machines;
+		t->changes ++;
+	}
+
+	return NULL;
+}
+
+/** Run $nthreads lookup threads at once, the i-th pinned to $cpus[i % $ncpus].
+	Returns aggregate lookups/s. */
+static double bench_step (struct chash_root *ch, const struct bench_conf_t *conf,
+			struct bench_thread_t *threads, int nthreads, const int *cpus, int ncpus, double base)
+{
+	int i;
+	uint64_t n = 0, l;
+	uint32_t *all;
+	double rate = 0, r;
+	pthread_barrier_t barrier;
+	struct bench_thread_t churn;
+
+	pthread_barrier_init (&barrier, NULL, nthreads);
+
+	memset (&churn, 0, sizeof (churn));
+	churn.ch = ch;
+	churn.conf = conf;
+	bench_stop = 0;
+	if (conf->churn_ms)
+		pthread_create (&churn.tid, NULL, bench_churn_thread, &churn);
+
+	for (i = 0; i < nthreads; i ++) {
+		threads[i].cpu = cpus[i % ncpus];
+		threads[i].ch = ch;
+		threads[i].conf = conf;
+		threads[i].barrier = &barrier;
+		threads[i].nsamples = 0;
+		pthread_create (&threads[i].tid, NULL, bench_lookup_thread, &threads[i]);
+	}
+
+	for (i = 0; i < nthreads; i ++) {
+		pthread_join (threads[i].tid, NULL);
+		n += threads[i].nsamples;
+	}
+
+	bench_stop = 1;
+	if (conf->churn_ms)
+		pthread_join (churn.tid, NULL);
+
+	pthread_barrier_destroy (&barrier);
+
+	/* Merge samples of all threads for the aggregate percentiles. */
+	all = (uint32_t *) malloc (sizeof (uint32_t) * (n + 1));
+	if (unlikely (!all)) {
+		printf ("Can not alloc memory. \n");
+		return 0;
+	}
+
+	for (i = 0, l = 0; i < nthreads; i ++) {
+		memcpy (&all[l], threads[i].samples, sizeof (uint32_t) * threads[i].nsamples);
+		l += threads[i].nsamples;
+		rate += (double)conf->lookups / threads[i].ns * 1e9;
+	}
+	qsort (all, n, sizeof (uint32_t), _u32_cmp);
+
+	printf ("%8d%14.2f%14.2f%10u%10u%10u%12.1f%s",
+		nthreads, rate / 1e6, rate / nthreads / 1e6,
+		_percentile (all, n, 0.50), _percentile (all, n, 0.99), _percentile (all, n, 0.999),
+		base ? rate / (base * nthreads) * 100 : 100.0, "%");
+	if (conf->churn_ms)
+		printf ("%10llu", (unsigned long long)churn.changes);
+	printf ("\n");
+
+	printf ("%8s", "");
+	for (i = 0; i < nthreads; i ++) {
+		r = (double)conf->lookups / threads[i].ns * 1e9;
+		printf (" %.2f@%d", r / 1e6, threads[i].cpu);
+	}
+	printf ("\n");
+
+	free (all);
+
+	return rate;
+}
+
+static void usage (const char *prog)
+{
+	printf ("Usage: %s [-n machines] [-v vnodes] [-t threads] [-l lookups] [-b batch] [-a algo] [-w ms] [-e engine]\n"
+		"    -n    Real node instances, default 1000\n"
+		"    -v    Virtual nodes per real node instance, default %d\n"
+		"    -t    Maximum threads, default all CPUs of the affinity mask\n"
+		"    -l    Lookups per thread at each step, default 4000000\n"
+		"    -b    Keys per node_lookup_batch call, default 0 (node_lookup_n)\n"
+		"    -a    Hash algorithm, 0 .. %d (HASH_ALGO_XXX), default %d\n"
+		"    -w    Remove & reinstall a node every ms milliseconds while looking up\n"
+		"    -e    Engine, ring, jump, maglev or hrw, default ring\n",
+		prog, NODE_DEFAULT_VNS, HASH_ALGO_MAX - 1, HASH_ALGO_DEFAULT);
+}
+
+int main (int argc, char **argv)
+{
+	int i, j, opt, ncpus, nthreads;
+	int cpus[CPU_SETSIZE];
+	double base = 0, rate;
+	char machine[32], ipaddr[32];
+	struct chash_root *ch;
+	struct node_t *n, **nodes;
+	struct bench_thread_t *threads;
+	static const struct chash_engine_t *engines[] = {&chash_engine_ring, &chash_engine_jump,
+								&chash_engine_maglev, &chash_engine_hrw};
+	struct bench_conf_t conf = {
+		.machines = 1000,
+		.vns = NODE_DEFAULT_VNS,
+		.threads = 0,
+		.batch = 0,
+		.algo = HASH_ALGO_DEFAULT,
+		.churn_ms = 0,
+		.lookups = 4000000,
+		.engine = &chash_engine_ring,
+	};
+
+	while ((opt = getopt (argc, argv, "n:v:t:l:b:a:w:e:h")) != -1) {
+		switch (opt) {
+		case 'n': conf.machines = atoi (optarg); break;
+		case 'v': conf.vns = atoi (optarg); break;
+		case 't': conf.threads = atoi (optarg); break;
+		case 'l': conf.lookups = strtoull (optarg, NULL, 10); break;
+		case 'b': conf.batch = atoi (optarg); break;
+		case 'a':
+			conf.algo = atoi (optarg);
+			if (conf.algo < 0 || conf.algo >= HASH_ALGO_MAX) {
+				usage (argv[0]);
+				return -1;
+			}
+			break;
+		case 'w': conf.churn_ms = atoi (optarg); break;
+		case 'e':
+			for (i = 0; i < (int)(sizeof (engines) / sizeof (engines[0])); i ++) {
+				if (!strcmp (optarg, engines[i]->name))
+					conf.engine = engines[i];
+			}
+			if (strcmp (optarg, conf.engine->name)) {
+				usage (argv[0]);
+				return -1;
+			}
+			break;
+		default:
+			usage (argv[0]);
+			return -1;
+		}
+	}
+
+	ncpus = _allowed_cpus (cpus);
+	if (conf.threads <= 0)
+		conf.threads = ncpus;
+	conf.threads = MIN (conf.threads, BENCH_THREADS_MAX);
+	conf.batch = MIN (MAX (conf.batch, 0), BENCH_BATCH_MAX);
+	if (conf.machines <= 0 || conf.machines > (1 << 24) || conf.vns <= 0 || !conf.lookups) {
+		usage (argv[0]);
+		return -1;
+	}
+
+	ch = chash_init (conf.algo);
+	threads = (struct bench_thread_t *) malloc (sizeof (struct bench_thread_t) * conf.threads);
+	nodes = (struct node_t **) malloc (sizeof (struct node_t *) * conf.machines);
+	if (unlikely (!ch || !threads || !nodes)) {
+		printf ("Can not alloc memory. \n");
+		return -1;
+	}
+
+	/* One allocation per node, the churn thread frees removed ones. */
+	for (i = 0; i < conf.machines; i ++) {
+		n = (struct node_t *) malloc (sizeof (struct node_t));
+		if (unlikely (!n)) {
+			printf ("Can not alloc memory. \n");
+			return -1;
+		}
+		memset (n, 0, sizeof (struct node_t));
+		sprintf (machine, "Machine_%d", i);
+		sprintf (ipaddr, "10.%d.%d.%d", (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+		node_set (n, machine, ipaddr, conf.vns);
+		nodes[i] = n;
+	}
+
+	ch->build_threads = ncpus;
+	ch->engine = conf.engine;
+	if (unlikely (chash_build (ch, nodes, conf.machines)))
+		return -1;
+	free (nodes);
+
+	/* Keys and latency samples of each thread. */
+	memset (threads, 0, sizeof (struct bench_thread_t) * conf.threads);
+	for (i = 0; i < conf.threads; i ++) {
+		threads[i].keys = malloc (sizeof (*threads[i].keys) * BENCH_KEYS);
+		threads[i].lens = (size_t *) malloc (sizeof (size_t) * BENCH_KEYS);
+		threads[i].samples = (uint32_t *) malloc (sizeof (uint32_t) *
+			((conf.lookups >> BENCH_SAMPLE_SHIFT) + 1));
+		if (unlikely (!threads[i].keys || !threads[i].lens || !threads[i].samples)) {
+			printf ("Can not alloc memory. \n");
+			return -1;
+		}
+		for (j = 0; j < BENCH_KEYS; j ++)
+			threads[i].lens[j] = sprintf (threads[i].keys[j], "key:%d:%d", i, j);
+	}
+
+	printf ("\n%d machines x %d vnodes, %s engine, %s, %s, %d CPUs, %llu lookups per thread%s\n",
+		conf.machines, conf.vns, conf.engine->name, hash_algo_name (conf.algo),
+		conf.batch ? "node_lookup_batch" : "node_lookup_n", ncpus,
+		(unsigned long long)conf.lookups, conf.churn_ms ? ", membership churn" : "");
+	if (conf.batch)
+		printf ("Latency is per batch of %d keys.\n", conf.batch);
+	if (conf.threads > ncpus)
+		printf ("More threads than CPUs, threads past %d share a CPU.\n", ncpus);
+	printf ("%8s%14s%14s%10s%10s%10s%13s%s\n", "THREADS", "MLOOKUPS/S", "PER-THREAD",
+		"P50(ns)", "P99(ns)", "P999(ns)", "EFFICIENCY", conf.churn_ms ? "   CHANGES" : "");
+
+	for (nthreads = 1; ; nthreads = MIN (nthreads * 2, conf.threads)) {
+		rate = bench_step (ch, &conf, threads, nthreads, cpus, ncpus, base);
+		if (nthreads == 1)
+			base = rate;
+		if (nthreads == conf.threads)
+			break;
+	}
+
+	return 0;
+}
+
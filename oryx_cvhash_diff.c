@@ -0,0 +1,213 @@
+/*
+ *   oryx_cvhash_diff.c
+ *   Func: Exact diff of two ring snapshots, arcs of the key space which changed owner
+ *   Personal.Q
+ */
+
+#include "oryx.h"
+#include "oryx_rbtree.h"
+#include "oryx_list.h"
+#include "oryx_ipc.h"
+#include "oryx_cvhash.h"
+#include "oryx_cvhash_ring.h"
+#include "oryx_cvhash_epoch.h"
+#include "oryx_cvhash_diff.h"
+
+#include <math.h>
+
+/** Greatest ring key. */
+#define RING_KEY_MAX	((ring_key_t)~(ring_key_t)0)
+
+/** Initial capacity of the arc array, doubled when full. */
+#define RING_DIFF_ARCS	64
+
+/*
+  * Diff node structure definnition.
+  * A compact node index of a ring keyed by the ipaddr of its node.
+  */
+struct diff_node_t {
+
+	const char *ipaddr;
+
+	int id;
+};
+
+static int _diff_cmp (const void *a, const void *b)
+{
+	return strcmp (((const struct diff_node_t *)a)->ipaddr, ((const struct diff_node_t *)b)->ipaddr);
+}
+
+/** Sort the compact node indexes of $r by ipaddr into $out. */
+static void _diff_sort_nodes (const struct ring_t *r, struct diff_node_t *out)
+{
+	int i;
+
+	for (i = 0; i < r->nns; i ++) {
+		out[i].ipaddr = r->nodes[i]->ipaddr;
+		out[i].id = i;
+	}
+
+	qsort (out, r->nns, sizeof (struct diff_node_t), _diff_cmp);
+}
+
+/** Map each node of $o to the node of $n with the same ipaddr, -1 if there is none.
+	The rings may belong to different roots (e.g. a chcopy clone), so nodes are
+	matched by their ipaddr, the key node_remove takes, and not by address. */
+static int _diff_map_nodes (const struct ring_t *o, const struct ring_t *n, int *map)
+{
+	int i = 0, j = 0, c;
+	struct diff_node_t *so, *sn;
+
+	so = (struct diff_node_t *) malloc (sizeof (struct diff_node_t) * (o->nns + 1));
+	sn = (struct diff_node_t *) malloc (sizeof (struct diff_node_t) * (n->nns + 1));
+	if (unlikely (!so || !sn)) {
+		free (so);
+		free (sn);
+		return -1;
+	}
+
+	_diff_sort_nodes (o, so);
+	_diff_sort_nodes (n, sn);
+
+	for (i = 0; i < o->nns; i ++)
+		map[i] = -1;
+
+	i = 0;
+	while (i < o->nns && j < n->nns) {
+		c = strcmp (so[i].ipaddr, sn[j].ipaddr);
+		if (c == 0)
+			map[so[i ++].id] = sn[j ++].id;
+		else if (c < 0)
+			i ++;
+		else
+			j ++;
+	}
+
+	free (so);
+	free (sn);
+
+	return 0;
+}
+
+/** Append keys $start .. $end moved from $o_node to $n_node, merged with the last arc
+	if it is adjacent and has the same owners. Returns -1 if out of memory. */
+static int _diff_emit (struct ring_arc_t **arcs, int *narcs, int *cap,
+			ring_key_t start, ring_key_t end, struct node_t *o_node, struct node_t *n_node)
+{
+	struct ring_arc_t *a;
+
+	if (*narcs) {
+		a = &(*arcs)[*narcs - 1];
+		if (a->old_node == o_node && a->new_node == n_node && a->end + 1 == start) {
+			a->end = end;
+			return 0;
+		}
+	}
+
+	if (*narcs == *cap) {
+		a = (struct ring_arc_t *) realloc (*arcs, sizeof (struct ring_arc_t) * (*cap) * 2);
+		if (unlikely (!a))
+			return -1;
+		*arcs = a;
+		*cap *= 2;
+	}
+
+	a = &(*arcs)[(*narcs) ++];
+	a->start = start;
+	a->end = end;
+	a->old_node = o_node;
+	a->new_node = n_node;
+
+	return 0;
+}
+
+/** Exact diff of ring $o (old) and ring $n (new).
+	Both sorted position arrays are merge walked once, every elementary interval
+	between two consecutive positions of either ring has a single owner in each,
+	the successor position (or the first one, wrapping around). Intervals whose
+	owners differ are returned in $arcs, ascending and merged when adjacent.
+	O(V_old + V_new + N log N) for N nodes, no key is hashed or searched.
+	$moved, if not NULL, is the fraction of the key space which changed owner.
+	Returns the count of arcs, $arcs must be freed by the caller, or -1 if out of memory
+	or either snapshot has no positions to diff (engine other than &chash_engine_ring). */
+int ring_diff (const struct ring_t *o, const struct ring_t *n,
+			struct ring_arc_t **arcs, double *moved)
+{
+	int io = 0, in = 0, oo, on, narcs = 0, cap = RING_DIFF_ARCS, last;
+	int *map;
+	ring_key_t lo = 0, p;
+	double keys = 0;
+
+	if (unlikely (o->engine->lookup || n->engine->lookup)) {
+		*arcs = NULL;
+		return -1;
+	}
+
+	*arcs = (struct ring_arc_t *) malloc (sizeof (struct ring_arc_t) * cap);
+	map = (int *) malloc (sizeof (int) * (o->nns + 1));
+	if (unlikely (!*arcs || !map || _diff_map_nodes (o, n, map)))
+		goto fail;
+
+	for (;;) {
+		/* Next boundary, the top of the key space after the last position. */
+		last = (io == o->nvns && in == n->nvns);
+		if (last)
+			p = RING_KEY_MAX;
+		else if (in == n->nvns || (io < o->nvns && o->pos[io] < n->pos[in]))
+			p = o->pos[io];
+		else
+			p = n->pos[in];
+
+		/* Owners of lo .. p, wrapping to the first position past the last one. */
+		oo = o->nvns ? (int)o->idx[io < o->nvns ? io : 0] : -1;
+		on = n->nvns ? (int)n->idx[in < n->nvns ? in : 0] : -1;
+
+		if ((oo < 0) ? (on >= 0) : (on < 0 || map[oo] != on)) {
+			if (unlikely (_diff_emit (arcs, &narcs, &cap, lo, p,
+					oo < 0 ? NULL : o->nodes[oo], on < 0 ? NULL : n->nodes[on])))
+				goto fail;
+		}
+
+		if (last || p == RING_KEY_MAX)
+			break;
+
+		if (io < o->nvns && o->pos[io] == p)
+			io ++;
+		if (in < n->nvns && n->pos[in] == p)
+			in ++;
+		lo = p + 1;
+	}
+
+	if (moved) {
+		for (oo = 0; oo < narcs; oo ++)
+			keys += ring_arc_keys (&(*arcs)[oo]);
+		*moved = keys / ldexp (1.0, RING_KEY_BITS);
+	}
+
+	free (map);
+
+	return narcs;
+
+fail:
+	free (*arcs);
+	free (map);
+	*arcs = NULL;
+
+	return -1;
+}
+
+/** Exact diff of the current rings of $o and $n, see ring_diff.
+	Nodes in $arcs are only guaranteed to stay valid within a read section
+	(epoch_read_lock) entered by the caller before this call. */
+int chash_diff (struct chash_root *o, struct chash_root *n,
+			struct ring_arc_t **arcs, double *moved)
+{
+	int narcs;
+
+	epoch_read_lock ();
+	narcs = ring_diff (ring_deref (o), ring_deref (n), arcs, moved);
+	epoch_read_unlock ();
+
+	return narcs;
+}
+
@@ -0,0 +1,41 @@
+/*
+ *   oryx_cvhash_diff.h
+ *   Func: Exact diff of two ring snapshots, arcs of the key space which changed owner
+ *   Personal.Q
+ */
+
+
+#ifndef __ORYX_CVHASH_DIFF_H__
+#define __ORYX_CVHASH_DIFF_H__
+
+/*
+  * Ring arc structure definnition.
+  * Keys start .. end (both inclusive) are mapped to $old_node by the old ring
+  * and to $new_node by the new one. Arcs never wrap around, the arc across
+  * the top of the key space is reported as two.
+  */
+struct ring_arc_t {
+
+	ring_key_t start;
+
+	ring_key_t end;
+
+	struct node_t *old_node;	/** NULL if the old ring is empty. */
+
+	struct node_t *new_node;	/** NULL if the new ring is empty. */
+};
+
+/** Keys covered by $arc, as a double since a whole 32 bit or 64 bit space does not fit. */
+static __oryx_always_inline__
+double ring_arc_keys (const struct ring_arc_t *arc)
+{
+	return (double)(arc->end - arc->start) + 1;
+}
+
+extern int ring_diff (const struct ring_t *o, const struct ring_t *n,
+			struct ring_arc_t **arcs, double *moved);
+extern int chash_diff (struct chash_root *o, struct chash_root *n,
+			struct ring_arc_t **arcs, double *moved);
+
+#endif
+
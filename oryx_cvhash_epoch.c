@@ -0,0 +1,201 @@
+/*
+ *   oryx_cvhash_epoch.c
+ *   Func: Epoch based reclamation for lock-free ring snapshot readers
+ *   Personal.Q
+ */
+
+#include "oryx.h"
+#include "oryx_ipc.h"
+#include "oryx_cvhash_epoch.h"
+
+/*
+  * A reader publishes the global epoch in its slot before it loads a ring
+  * snapshot and clears it when done, without any lock or loop, so readers
+  * are wait-free. A writer unpublishes an object first, then retires it
+  * with the global epoch (E) and advances the global epoch. Readers which
+  * entered later observed an epoch greater than E and can not see the object,
+  * so it is freed once no slot holds an epoch less than or equal to E.
+  */
+static struct epoch_reader_t epoch_readers[EPOCH_READERS_MAX];
+
+/** High-water mark of used slots, writers scan epoch_readers[0 .. epoch_nreaders). */
+static int epoch_nreaders;
+
+/** Readers within a read section which have no slot. */
+static uint64_t epoch_overflow;
+
+static uint64_t epoch_global = 1;
+
+static struct epoch_retired_t *epoch_retired;
+
+static INIT_MUTEX(epoch_lock);
+
+static pthread_key_t epoch_key;
+
+static __thread struct epoch_reader_t *epoch_self;
+__thread int epoch_id = -1;
+static __thread int epoch_registered;
+static __thread int epoch_nesting;
+
+/** Release the slot of an exiting thread. */
+static void _epoch_unregister (void *p)
+{
+	struct epoch_reader_t *slot = (struct epoch_reader_t *)p;
+
+	__atomic_store_n (&slot->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n (&slot->used, 0, __ATOMIC_RELEASE);
+}
+
+/** Take a free slot for this thread, once, on its first read section. */
+static void _epoch_register (void)
+{
+	int i, n, unused = 0;
+
+	epoch_registered = 1;
+
+	for (i = 0; i < EPOCH_READERS_MAX; i ++) {
+		if (__atomic_compare_exchange_n (&epoch_readers[i].used, &unused, 1,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+		unused = 0;
+	}
+
+	if (unlikely (i == EPOCH_READERS_MAX))
+		return;
+
+	n = __atomic_load_n (&epoch_nreaders, __ATOMIC_RELAXED);
+	while (n < i + 1 &&
+		!__atomic_compare_exchange_n (&epoch_nreaders, &n, i + 1,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	epoch_self = &epoch_readers[i];
+	epoch_id = i;
+	pthread_setspecific (epoch_key, epoch_self);
+}
+
+/** Enter a read section. Ring snapshots, and nodes reached through them,
+	loaded within a read section stay valid until epoch_read_unlock.
+	Read sections may be nested. */
+void epoch_read_lock (void)
+{
+	if (epoch_nesting ++)
+		return;
+
+	if (unlikely (!epoch_registered))
+		_epoch_register ();
+
+	if (likely (epoch_self))
+		__atomic_store_n (&epoch_self->epoch,
+			__atomic_load_n (&epoch_global, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add (&epoch_overflow, 1, __ATOMIC_RELAXED);
+
+	/* The slot must be visible to writers before any snapshot is loaded. */
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+/** Leave a read section. */
+void epoch_read_unlock (void)
+{
+	if (-- epoch_nesting)
+		return;
+
+	if (likely (epoch_self))
+		__atomic_store_n (&epoch_self->epoch, 0, __ATOMIC_RELEASE);
+	else
+		__atomic_fetch_sub (&epoch_overflow, 1, __ATOMIC_RELEASE);
+}
+
+/** Minimum epoch of active readers, UINT64_MAX if there is none,
+	0 if a reader without slot is active. */
+static uint64_t _epoch_min (void)
+{
+	int i, n;
+	uint64_t e, min = UINT64_MAX;
+
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n (&epoch_overflow, __ATOMIC_ACQUIRE))
+		return 0;
+
+	n = __atomic_load_n (&epoch_nreaders, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i ++) {
+		e = __atomic_load_n (&epoch_readers[i].epoch, __ATOMIC_ACQUIRE);
+		if (e && e < min)
+			min = e;
+	}
+
+	return min;
+}
+
+/** Free retired objects which no reader can hold any more. Never blocks on readers. */
+void epoch_reclaim (void)
+{
+	uint64_t min;
+	struct epoch_retired_t **pp, *o;
+
+	oryx_thread_mutex_lock (&epoch_lock);
+
+	min = _epoch_min ();
+
+	pp = &epoch_retired;
+	while (NULL != (o = *pp)) {
+		if (o->epoch < min) {
+			*pp = o->next;
+			o->fn (o->p);
+			free (o);
+		} else
+			pp = &o->next;
+	}
+
+	oryx_thread_mutex_unlock (&epoch_lock);
+}
+
+/** Free $p with $fn once all readers which may hold it have left their
+	read sections. $p must have been unpublished by the caller already. */
+void epoch_retire (void *p, void (*fn) (void *))
+{
+	struct epoch_retired_t *o;
+
+	o = (struct epoch_retired_t *) malloc (sizeof (struct epoch_retired_t));
+	if (unlikely (!o)) {
+		/* Can not defer, wait for the readers instead. */
+		epoch_synchronize ();
+		fn (p);
+		return;
+	}
+
+	o->p = p;
+	o->fn = fn;
+
+	oryx_thread_mutex_lock (&epoch_lock);
+	o->epoch = __atomic_fetch_add (&epoch_global, 1, __ATOMIC_SEQ_CST);
+	o->next = epoch_retired;
+	epoch_retired = o;
+	oryx_thread_mutex_unlock (&epoch_lock);
+
+	epoch_reclaim ();
+}
+
+/** Wait until all read sections entered before this call have been left,
+	then free what can be freed. Anything unpublished before this call,
+	such as a node removed from a ring, can be freed by the caller after it.
+	Must not be called within a read section. */
+void epoch_synchronize (void)
+{
+	uint64_t e;
+
+	e = __atomic_fetch_add (&epoch_global, 1, __ATOMIC_SEQ_CST);
+
+	while (_epoch_min () <= e)
+		sched_yield ();
+
+	epoch_reclaim ();
+}
+
+__attribute__((constructor))
+static void epoch_init (void)
+{
+	pthread_key_create (&epoch_key, _epoch_unregister);
+}
+
@@ -0,0 +1,49 @@
+/*
+ *   oryx_cvhash_epoch.h
+ *   Func: Epoch based reclamation for lock-free ring snapshot readers
+ *   Personal.Q
+ */
+
+
+#ifndef __ORYX_CVHASH_EPOCH_H__
+#define __ORYX_CVHASH_EPOCH_H__
+
+/** Count of reader threads which own a slot. Readers beyond it share
+	a counter which holds back all reclamation while they are active. */
+#define EPOCH_READERS_MAX	256
+
+/*
+  * Epoch reader slot structure definnition.
+  * One per reader thread, a cache line each so that readers never share one.
+  */
+struct epoch_reader_t {
+
+	uint64_t epoch;	/** Global epoch observed when entering a read section, 0 when quiescent. */
+
+	int used;		/** Owned by a thread. */
+
+} __attribute__((aligned(64)));
+
+/*
+  * Retired object structure definnition.
+  * An object unpublished by a writer, freed by $fn once no reader can hold it.
+  */
+struct epoch_retired_t {
+
+	struct epoch_retired_t *next;
+
+	void *p;
+
+	void (*fn) (void *);
+
+	uint64_t epoch;	/** Global epoch when $p was retired. */
+};
+
+extern void epoch_read_lock (void);
+extern void epoch_read_unlock (void);
+extern void epoch_retire (void *p, void (*fn) (void *));
+extern void epoch_reclaim (void);
+extern void epoch_synchronize (void);
+
+#endif
+
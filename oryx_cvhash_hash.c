@@ -0,0 +1,607 @@
+/*
+ *   oryx_cvhash_hash.c
+ *   Func: Hash algorithms family for consistent hash ring
+ *   Personal.Q
+ */
+
+#include "oryx.h"
+#include "oryx_rbtree.h"
+#include "oryx_list.h"
+#include "oryx_ipc.h"
+#include "oryx_cvhash.h"
+#include "oryx_cvhash_hash.h"
+
+#include <immintrin.h>
+
+/** Unaligned little endian loads. */
+static __oryx_always_inline__
+uint32_t _rd32 (const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy (&v, p, sizeof (v));
+	return v;
+}
+
+static __oryx_always_inline__
+uint64_t _rd64 (const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy (&v, p, sizeof (v));
+	return v;
+}
+
+static __oryx_always_inline__
+uint32_t _rotl32 (uint32_t x, int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+static __oryx_always_inline__
+uint64_t _rotl64 (uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+uint32_t md5_hash (char *instr, size_t s)
+{
+	int i;
+	long hash = 0;
+	unsigned char digest[16];
+	apr_md5_ctx_t context;
+
+	apr_md5_init(&context);
+	apr_md5_update (&context, instr, s);
+	apr_md5_final (digest, &context);
+
+	/* use successive 4-bytes from hash as numbers */
+	for (i = 0; i < 4; i++) {
+	    hash += ((long)(digest[i*4 + 3]&0xFF) << 24)
+	        | ((long)(digest[i*4 + 2]&0xFF) << 16)
+	        | ((long)(digest[i*4 + 1]&0xFF) <<  8)
+	        | ((long)(digest[i*4 + 0]&0xFF));
+	}
+
+	return hash;
+}
+
+/** MD5 digest used by ketama. */
+void ketama_digest (char *instr, size_t s, unsigned char *digest)
+{
+	apr_md5_ctx_t context;
+
+	apr_md5_init (&context);
+	apr_md5_update (&context, instr, s);
+	apr_md5_final (digest, &context);
+}
+
+uint32_t ketama_hash (char *instr, size_t s)
+{
+	unsigned char digest[16];
+
+	ketama_digest (instr, s, digest);
+	return ketama_point (digest, 0);
+}
+
+/** Ketama points are 32 bit in a 64 bit ring as well, so that placement
+	stays compatible with libmemcached & twemproxy, see KETAMA_KEY. */
+uint64_t ketama_hash64 (char *instr, size_t s)
+{
+	return KETAMA_KEY (ketama_hash (instr, s));
+}
+
+/** MD5 with the two 64 bit little endian digest words summed. */
+uint64_t md5_hash64 (char *instr, size_t s)
+{
+	unsigned char digest[16];
+	apr_md5_ctx_t context;
+
+	apr_md5_init (&context);
+	apr_md5_update (&context, instr, s);
+	apr_md5_final (digest, &context);
+
+	return _rd64 (digest) + _rd64 (digest + 8);
+}
+
+uint32_t fnv1a_hash (char *instr, size_t s)
+{
+	size_t i;
+	uint32_t h = 2166136261U;
+
+	for (i = 0; i < s; i ++) {
+		h ^= (uint8_t)instr[i];
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+uint64_t fnv1a_hash64 (char *instr, size_t s)
+{
+	size_t i;
+	uint64_t h = 14695981039346656037ULL;
+
+	for (i = 0; i < s; i ++) {
+		h ^= (uint8_t)instr[i];
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+uint32_t murmur3_hash (char *instr, size_t s)
+{
+	size_t i, nblocks = s / 4;
+	const uint8_t *p = (const uint8_t *)instr;
+	const uint8_t *tail = p + nblocks * 4;
+	const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+	uint32_t h = 0, k;
+
+	for (i = 0; i < nblocks; i ++) {
+		k = _rd32 (p + i * 4);
+		k *= c1;
+		k = _rotl32 (k, 15);
+		k *= c2;
+		h ^= k;
+		h = _rotl32 (h, 13);
+		h = h * 5 + 0xe6546b64;
+	}
+
+	k = 0;
+	switch (s & 3) {
+	case 3: k ^= tail[2] << 16;	/* fall through */
+	case 2: k ^= tail[1] << 8;	/* fall through */
+	case 1: k ^= tail[0];
+		k *= c1;
+		k = _rotl32 (k, 15);
+		k *= c2;
+		h ^= k;
+	}
+
+	h ^= (uint32_t)s;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static __oryx_always_inline__
+uint64_t _fmix64 (uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+
+	return k;
+}
+
+/** MurmurHash3 x64_128, the low 64 bit half. */
+uint64_t murmur3_hash64 (char *instr, size_t s)
+{
+	size_t i, nblocks = s / 16;
+	const uint8_t *p = (const uint8_t *)instr;
+	const uint8_t *tail = p + nblocks * 16;
+	const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0, h2 = 0, k1, k2;
+
+	for (i = 0; i < nblocks; i ++) {
+		k1 = _rd64 (p + i * 16);
+		k2 = _rd64 (p + i * 16 + 8);
+
+		k1 *= c1;
+		k1 = _rotl64 (k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+		h1 = _rotl64 (h1, 27);
+		h1 += h2;
+		h1 = h1 * 5 + 0x52dce729;
+
+		k2 *= c2;
+		k2 = _rotl64 (k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+		h2 = _rotl64 (h2, 31);
+		h2 += h1;
+		h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	k1 = k2 = 0;
+	switch (s & 15) {
+	case 15: k2 ^= (uint64_t)tail[14] << 48;	/* fall through */
+	case 14: k2 ^= (uint64_t)tail[13] << 40;	/* fall through */
+	case 13: k2 ^= (uint64_t)tail[12] << 32;	/* fall through */
+	case 12: k2 ^= (uint64_t)tail[11] << 24;	/* fall through */
+	case 11: k2 ^= (uint64_t)tail[10] << 16;	/* fall through */
+	case 10: k2 ^= (uint64_t)tail[9] << 8;	/* fall through */
+	case 9: k2 ^= (uint64_t)tail[8];
+		k2 *= c2;
+		k2 = _rotl64 (k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+		/* fall through */
+	case 8: k1 ^= (uint64_t)tail[7] << 56;	/* fall through */
+	case 7: k1 ^= (uint64_t)tail[6] << 48;	/* fall through */
+	case 6: k1 ^= (uint64_t)tail[5] << 40;	/* fall through */
+	case 5: k1 ^= (uint64_t)tail[4] << 32;	/* fall through */
+	case 4: k1 ^= (uint64_t)tail[3] << 24;	/* fall through */
+	case 3: k1 ^= (uint64_t)tail[2] << 16;	/* fall through */
+	case 2: k1 ^= (uint64_t)tail[1] << 8;	/* fall through */
+	case 1: k1 ^= (uint64_t)tail[0];
+		k1 *= c1;
+		k1 = _rotl64 (k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+	}
+
+	h1 ^= (uint64_t)s;
+	h2 ^= (uint64_t)s;
+	h1 += h2;
+	h2 += h1;
+	h1 = _fmix64 (h1);
+	h2 = _fmix64 (h2);
+	h1 += h2;
+
+	return h1;
+}
+
+#define XXH_P1	2654435761U
+#define XXH_P2	2246822519U
+#define XXH_P3	3266489917U
+#define XXH_P4	668265263U
+#define XXH_P5	374761393U
+
+static __oryx_always_inline__
+uint32_t _xxh32_round (uint32_t acc, uint32_t v)
+{
+	acc += v * XXH_P2;
+	acc = _rotl32 (acc, 13);
+	return acc * XXH_P1;
+}
+
+uint32_t xxhash32_hash (char *instr, size_t s)
+{
+	const uint8_t *p = (const uint8_t *)instr;
+	const uint8_t *end = p + s;
+	uint32_t h, v1, v2, v3, v4;
+
+	if (s >= 16) {
+		v1 = XXH_P1 + XXH_P2;
+		v2 = XXH_P2;
+		v3 = 0;
+		v4 = 0 - XXH_P1;
+		do {
+			v1 = _xxh32_round (v1, _rd32 (p));
+			v2 = _xxh32_round (v2, _rd32 (p + 4));
+			v3 = _xxh32_round (v3, _rd32 (p + 8));
+			v4 = _xxh32_round (v4, _rd32 (p + 12));
+			p += 16;
+		} while (p + 16 <= end);
+		h = _rotl32 (v1, 1) + _rotl32 (v2, 7) + _rotl32 (v3, 12) + _rotl32 (v4, 18);
+	} else
+		h = XXH_P5;
+
+	h += (uint32_t)s;
+
+	while (p + 4 <= end) {
+		h += _rd32 (p) * XXH_P3;
+		h = _rotl32 (h, 17) * XXH_P4;
+		p += 4;
+	}
+
+	while (p < end) {
+		h += (*p) * XXH_P5;
+		h = _rotl32 (h, 11) * XXH_P1;
+		p ++;
+	}
+
+	h ^= h >> 15;
+	h *= XXH_P2;
+	h ^= h >> 13;
+	h *= XXH_P3;
+	h ^= h >> 16;
+
+	return h;
+}
+
+#define XXH64_P1	11400714785074694791ULL
+#define XXH64_P2	14029467366897019727ULL
+#define XXH64_P3	1609587929392839161ULL
+#define XXH64_P4	9650029242287828579ULL
+#define XXH64_P5	2870177450012600261ULL
+
+static __oryx_always_inline__
+uint64_t _xxh64_round (uint64_t acc, uint64_t v)
+{
+	acc += v * XXH64_P2;
+	acc = _rotl64 (acc, 31);
+	return acc * XXH64_P1;
+}
+
+static __oryx_always_inline__
+uint64_t _xxh64_merge (uint64_t acc, uint64_t v)
+{
+	acc ^= _xxh64_round (0, v);
+	return acc * XXH64_P1 + XXH64_P4;
+}
+
+uint64_t xxhash64_hash (char *instr, size_t s)
+{
+	const uint8_t *p = (const uint8_t *)instr;
+	const uint8_t *end = p + s;
+	uint64_t h, v1, v2, v3, v4;
+
+	if (s >= 32) {
+		v1 = XXH64_P1 + XXH64_P2;
+		v2 = XXH64_P2;
+		v3 = 0;
+		v4 = 0 - XXH64_P1;
+		do {
+			v1 = _xxh64_round (v1, _rd64 (p));
+			v2 = _xxh64_round (v2, _rd64 (p + 8));
+			v3 = _xxh64_round (v3, _rd64 (p + 16));
+			v4 = _xxh64_round (v4, _rd64 (p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+		h = _rotl64 (v1, 1) + _rotl64 (v2, 7) + _rotl64 (v3, 12) + _rotl64 (v4, 18);
+		h = _xxh64_merge (h, v1);
+		h = _xxh64_merge (h, v2);
+		h = _xxh64_merge (h, v3);
+		h = _xxh64_merge (h, v4);
+	} else
+		h = XXH64_P5;
+
+	h += (uint64_t)s;
+
+	while (p + 8 <= end) {
+		h ^= _xxh64_round (0, _rd64 (p));
+		h = _rotl64 (h, 27) * XXH64_P1 + XXH64_P4;
+		p += 8;
+	}
+
+	if (p + 4 <= end) {
+		h ^= (uint64_t)_rd32 (p) * XXH64_P1;
+		h = _rotl64 (h, 23) * XXH64_P2 + XXH64_P3;
+		p += 4;
+	}
+
+	while (p < end) {
+		h ^= (*p) * XXH64_P5;
+		h = _rotl64 (h, 11) * XXH64_P1;
+		p ++;
+	}
+
+	h ^= h >> 33;
+	h *= XXH64_P2;
+	h ^= h >> 29;
+	h *= XXH64_P3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+static const uint64_t _wyp[4] = {
+	0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+	0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static __oryx_always_inline__
+void _wymum (uint64_t *a, uint64_t *b)
+{
+	__uint128_t r = *a;
+
+	r *= *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+}
+
+static __oryx_always_inline__
+uint64_t _wymix (uint64_t a, uint64_t b)
+{
+	_wymum (&a, &b);
+	return a ^ b;
+}
+
+static __oryx_always_inline__
+uint64_t _wyr3 (const uint8_t *p, size_t k)
+{
+	return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+static __oryx_always_inline__
+uint64_t _wyhash (char *instr, size_t s)
+{
+	const uint8_t *p = (const uint8_t *)instr;
+	uint64_t seed = 0, a, b, see1, see2, h;
+	size_t i = s;
+
+	seed ^= _wymix (seed ^ _wyp[0], _wyp[1]);
+
+	if (likely (s <= 16)) {
+		if (likely (s >= 4)) {
+			a = ((uint64_t)_rd32 (p) << 32) | _rd32 (p + ((s >> 3) << 2));
+			b = ((uint64_t)_rd32 (p + s - 4) << 32) | _rd32 (p + s - 4 - ((s >> 3) << 2));
+		}
+		else if (likely (s > 0)) {
+			a = _wyr3 (p, s);
+			b = 0;
+		}
+		else
+			a = b = 0;
+	} else {
+		if (unlikely (i >= 48)) {
+			see1 = seed;
+			see2 = seed;
+			do {
+				seed = _wymix (_rd64 (p) ^ _wyp[1], _rd64 (p + 8) ^ seed);
+				see1 = _wymix (_rd64 (p + 16) ^ _wyp[2], _rd64 (p + 24) ^ see1);
+				see2 = _wymix (_rd64 (p + 32) ^ _wyp[3], _rd64 (p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (likely (i >= 48));
+			seed ^= see1 ^ see2;
+		}
+		while (unlikely (i > 16)) {
+			seed = _wymix (_rd64 (p) ^ _wyp[1], _rd64 (p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = _rd64 (p + i - 16);
+		b = _rd64 (p + i - 8);
+	}
+
+	a ^= _wyp[1];
+	b ^= seed;
+	_wymum (&a, &b);
+	h = _wymix (a ^ _wyp[0] ^ s, b ^ _wyp[1]);
+
+	return h;
+}
+
+uint32_t wyhash_hash (char *instr, size_t s)
+{
+	uint64_t h = _wyhash (instr, s);
+
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+uint64_t wyhash_hash64 (char *instr, size_t s)
+{
+	return _wyhash (instr, s);
+}
+
+/** CRC32C software table, reflected Castagnoli polynomial. */
+static uint32_t _crc32c_table[256];
+
+static uint32_t _crc32c_sw (const uint8_t *p, size_t s)
+{
+	uint32_t crc = ~0U;
+
+	while (s --)
+		crc = _crc32c_table[(crc ^ *p ++) & 0xFF] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t _crc32c_hw (const uint8_t *p, size_t s)
+{
+	uint64_t crc = ~0U;
+
+	for (; s >= 8; s -= 8, p += 8)
+		crc = _mm_crc32_u64 (crc, _rd64 (p));
+
+	for (; s > 0; s --, p ++)
+		crc = _mm_crc32_u8 ((uint32_t)crc, *p);
+
+	return ~(uint32_t)crc;
+}
+
+/** CRC32C of the bytes of $p in reverse order. */
+static uint32_t _crc32c_rev_sw (const uint8_t *p, size_t s)
+{
+	uint32_t crc = ~0U;
+
+	while (s --)
+		crc = _crc32c_table[(crc ^ p[s]) & 0xFF] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t _crc32c_rev_hw (const uint8_t *p, size_t s)
+{
+	uint64_t crc = ~0U;
+
+	for (; s >= 8; s -= 8)
+		crc = _mm_crc32_u64 (crc, __builtin_bswap64 (_rd64 (p + s - 8)));
+
+	for (; s > 0; s --)
+		crc = _mm_crc32_u8 ((uint32_t)crc, p[s - 1]);
+
+	return ~(uint32_t)crc;
+}
+
+static uint32_t (*_crc32c) (const uint8_t *p, size_t s) = _crc32c_sw;
+static uint32_t (*_crc32c_rev) (const uint8_t *p, size_t s) = _crc32c_rev_sw;
+
+uint32_t crc32c_hash (char *instr, size_t s)
+{
+	return _crc32c ((const uint8_t *)instr, s);
+}
+
+/** CRC32C is linear, a second CRC32C of the key with another initial value
+	differs from the first by a constant of the length only. The key reversed
+	is a different linear function of the key, so the two words are independent. */
+uint64_t crc32c_hash64 (char *instr, size_t s)
+{
+	return ((uint64_t)_crc32c ((const uint8_t *)instr, s) << 32) |
+		_crc32c_rev ((const uint8_t *)instr, s);
+}
+
+/** Build the CRC32C table and select the crc32 instruction if present, once at startup. */
+__attribute__((constructor))
+static void crc32c_init (void)
+{
+	int i, j;
+	uint32_t c;
+
+	for (i = 0; i < 256; i ++) {
+		c = i;
+		for (j = 0; j < 8; j ++)
+			c = (c & 1) ? (c >> 1) ^ 0x82F63B78U : (c >> 1);
+		_crc32c_table[i] = c;
+	}
+
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("sse4.2")) {
+		_crc32c = _crc32c_hw;
+		_crc32c_rev = _crc32c_rev_hw;
+	}
+}
+
+static const struct {
+	const char *name;
+	hash_fun_ptr fn;
+} hash_algos[HASH_ALGO_MAX] = {
+#ifdef CHASH_RING64
+	[HASH_ALGO_MD5]		= {"md5",	md5_hash64},
+	[HASH_ALGO_FNV1A]	= {"fnv1a64",	fnv1a_hash64},
+	[HASH_ALGO_MURMUR3]	= {"murmur3",	murmur3_hash64},
+	[HASH_ALGO_XXHASH]	= {"xxhash64",	xxhash64_hash},
+	[HASH_ALGO_WYHASH]	= {"wyhash",	wyhash_hash64},
+	[HASH_ALGO_CRC32C]	= {"crc32c",	crc32c_hash64},
+	[HASH_ALGO_KETAMA]	= {"ketama",	ketama_hash64},
+#else
+	[HASH_ALGO_MD5]		= {"md5",	md5_hash},
+	[HASH_ALGO_FNV1A]	= {"fnv1a",	fnv1a_hash},
+	[HASH_ALGO_MURMUR3]	= {"murmur3",	murmur3_hash},
+	[HASH_ALGO_XXHASH]	= {"xxhash32",	xxhash32_hash},
+	[HASH_ALGO_WYHASH]	= {"wyhash",	wyhash_hash},
+	[HASH_ALGO_CRC32C]	= {"crc32c",	crc32c_hash},
+	[HASH_ALGO_KETAMA]	= {"ketama",	ketama_hash},
+#endif
+};
+
+/** Hash function of $algo, MD5 for unknown algorithms. */
+hash_fun_ptr hash_algo_func (int algo)
+{
+	if (unlikely (algo < 0 || algo >= HASH_ALGO_MAX))
+		algo = HASH_ALGO_MD5;
+
+	return hash_algos[algo].fn;
+}
+
+const char *hash_algo_name (int algo)
+{
+	if (unlikely (algo < 0 || algo >= HASH_ALGO_MAX))
+		return "unknown";
+
+	return hash_algos[algo].name;
+}
+
@@ -0,0 +1,73 @@
+/*
+ *   oryx_cvhash_hash.h
+ *   Func: Hash algorithms family for consistent hash ring
+ *   Personal.Q
+ */
+
+
+#ifndef __ORYX_CVHASH_HASH_H__
+#define __ORYX_CVHASH_HASH_H__
+
+/** Hash algorithms which can be selected by chash_init.
+	A 64 bit ring (CHASH_RING64) uses the 64 bit variant noted in brackets. */
+enum {
+	HASH_ALGO_MD5,		/** APR MD5 with the four digest words summed, compatibility mode.
+							(the two 64 bit digest words summed) */
+	HASH_ALGO_FNV1A,	/** 32 bit FNV-1a. (64 bit FNV-1a) */
+	HASH_ALGO_MURMUR3,	/** MurmurHash3 x86_32. (low half of MurmurHash3 x64_128) */
+	HASH_ALGO_XXHASH,	/** xxHash32. (xxHash64) */
+	HASH_ALGO_WYHASH,	/** wyhash, 64 bit output folded to 32 bit. (not folded) */
+	HASH_ALGO_CRC32C,	/** CRC32C (Castagnoli), SSE4.2 crc32 instruction if present.
+							(CRC32C of the key and of the key reversed, concatenated) */
+	HASH_ALGO_KETAMA,	/** Ketama continuum, compatible with libmemcached & twemproxy.
+							Keys are hashed to the first little endian word of their MD5 digest,
+							and each MD5 digest of "<ipaddr>-<j>" yields four virtual nodes.
+							(same 32 bit points in the high word, so the placement stays compatible) */
+	HASH_ALGO_MAX,
+};
+
+/** Default hash algorithm, stays MD5 so that existing rings keep their placement. */
+#define HASH_ALGO_DEFAULT	HASH_ALGO_MD5
+
+extern uint32_t md5_hash (char *instr, size_t s);
+extern uint32_t fnv1a_hash (char *instr, size_t s);
+extern uint32_t murmur3_hash (char *instr, size_t s);
+extern uint32_t xxhash32_hash (char *instr, size_t s);
+extern uint32_t wyhash_hash (char *instr, size_t s);
+extern uint32_t crc32c_hash (char *instr, size_t s);
+extern uint32_t ketama_hash (char *instr, size_t s);
+extern void ketama_digest (char *instr, size_t s, unsigned char *digest);
+
+extern uint64_t md5_hash64 (char *instr, size_t s);
+extern uint64_t fnv1a_hash64 (char *instr, size_t s);
+extern uint64_t murmur3_hash64 (char *instr, size_t s);
+extern uint64_t xxhash64_hash (char *instr, size_t s);
+extern uint64_t wyhash_hash64 (char *instr, size_t s);
+extern uint64_t crc32c_hash64 (char *instr, size_t s);
+extern uint64_t ketama_hash64 (char *instr, size_t s);
+
+/** The $h-th (0..3) ketama point of a 16 bytes MD5 digest, a little endian word. */
+static __oryx_always_inline__
+uint32_t ketama_point (const unsigned char *digest, int h)
+{
+	return ((uint32_t)digest[3 + h * 4] << 24) |
+		((uint32_t)digest[2 + h * 4] << 16) |
+		((uint32_t)digest[1 + h * 4] << 8) |
+		((uint32_t)digest[h * 4]);
+}
+
+/** Ring key of the ketama point $p. A 64 bit ring takes it as the high word, so that
+	keys span the whole key space as those of the other algorithms do, which prefix
+	buckets, Maglev tables and ring shares rely on. Points and keys keep their order,
+	so every key goes to the server of the 32 bit continuum. */
+#ifdef CHASH_RING64
+#define KETAMA_KEY(p)	((uint64_t)(p) << 32)
+#else
+#define KETAMA_KEY(p)	(p)
+#endif
+
+extern hash_fun_ptr hash_algo_func (int algo);
+extern const char *hash_algo_name (int algo);
+
+#endif
+
@@ -0,0 +1,246 @@
+/*
+ *   oryx_cvhash_hrw.c
+ *   Func: Rendezvous (highest random weight) hashing engine with AVX2 scoring
+ *   Personal.Q
+ */
+
+#include "oryx.h"
+#include "oryx_rbtree.h"
+#include "oryx_list.h"
+#include "oryx_ipc.h"
+#include "oryx_cvhash.h"
+#include "oryx_cvhash_ring.h"
+
+#include <math.h>
+#include <immintrin.h>
+
+/*
+  * Rendezvous hashing (Thaler & Ravishankar). Every node scores a key with
+  * mix (key ^ seed) and the key goes to the highest score, the next highest
+  * ones are its replicas. Removing a node only moves the keys it owned, adding
+  * one only moves the keys it now wins, with no virtual node at all.
+  * A lookup scores all N nodes, so it suits small clusters (under 64 nodes).
+  *
+  * Scores are the 32 bit murmur3 finalizer, AVX2 has no 64 bit multiply, so
+  * 8 nodes are scored per instruction. A 64 bit hash value is folded first.
+  * Ties, 1 in 2^32 per pair, go to the node installed first.
+  *
+  * Nodes are weighted by node_t.replicas, if they differ, with the logarithmic
+  * method, score = weight / -ln (u) for u the mix in (0, 1), which gives every
+  * node a share proportional to its weight. Weighted scoring is scalar.
+  */
+
+/** Murmur3 32 bit finalizer. */
+#define HRW_MIX(h) do {\
+		(h) ^= (h) >> 16; (h) *= 0x85ebca6bU;\
+		(h) ^= (h) >> 13; (h) *= 0xc2b2ae35U;\
+		(h) ^= (h) >> 16;\
+	} while (0)
+
+/** Scoring kernel selected at startup (AVX2 or scalar), index of the highest score
+	of $seed[0 .. n) for the folded key $k. */
+static int (*hrw_argmax) (const uint32_t *seed, int n, uint32_t k);
+const char *hrw_isa = "scalar";
+
+static __oryx_always_inline__
+uint32_t _hrw_fold (ring_key_t hv)
+{
+	return (uint32_t)((uint64_t)hv ^ ((uint64_t)hv >> 32));
+}
+
+static __oryx_always_inline__
+uint32_t _hrw_score (uint32_t seed, uint32_t k)
+{
+	uint32_t h = seed ^ k;
+
+	HRW_MIX (h);
+
+	return h;
+}
+
+/** Weighted score of a node of weight $w with the mix $h. */
+static __oryx_always_inline__
+double _hrw_wscore (double w, uint32_t h)
+{
+	return w / -log (((double)h + 0.5) / 4294967296.0);
+}
+
+static int _hrw_argmax_scalar (const uint32_t *seed, int n, uint32_t k)
+{
+	int i, best = 0;
+	uint32_t s, bs = 0;
+
+	for (i = 0; i < n; i ++) {
+		s = _hrw_score (seed[i], k);
+		if (!i || s > bs) {
+			bs = s;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+__attribute__((target("avx2")))
+static __oryx_always_inline__
+__m256i _hrw_mix_avx2 (__m256i h)
+{
+	h = _mm256_xor_si256 (h, _mm256_srli_epi32 (h, 16));
+	h = _mm256_mullo_epi32 (h, _mm256_set1_epi32 ((int)0x85ebca6bU));
+	h = _mm256_xor_si256 (h, _mm256_srli_epi32 (h, 13));
+	h = _mm256_mullo_epi32 (h, _mm256_set1_epi32 ((int)0xc2b2ae35U));
+	h = _mm256_xor_si256 (h, _mm256_srli_epi32 (h, 16));
+
+	return h;
+}
+
+/** 8 nodes a step, lane j keeps the best of nodes j, j + 8, ... Seeds are padded
+	to a multiple of 8, lanes past $n are masked out. Scores are biased by the sign
+	bit, AVX2 only has signed compares. The lanes are reduced without a branch,
+	to the highest score and the lowest node index holding it. */
+__attribute__((target("avx2")))
+static int _hrw_argmax_avx2 (const uint32_t *seed, int n, uint32_t k)
+{
+	int i, best;
+	__m256i nv = _mm256_set1_epi32 (n);
+	__m256i kv = _mm256_set1_epi32 ((int)k);
+	__m256i bias = _mm256_set1_epi32 (INT32_MIN);
+	__m256i bv = bias, bi = _mm256_set1_epi32 (INT32_MAX);
+	__m256i iv = _mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i step = _mm256_set1_epi32 (8);
+	__m256i h, gt, m;
+
+	for (i = 0; i < n; i += 8) {
+		h = _hrw_mix_avx2 (_mm256_xor_si256 (_mm256_load_si256 ((const __m256i *)(seed + i)), kv));
+		h = _mm256_xor_si256 (h, bias);
+		gt = _mm256_and_si256 (_mm256_cmpgt_epi32 (h, bv), _mm256_cmpgt_epi32 (nv, iv));
+		bv = _mm256_blendv_epi8 (bv, h, gt);
+		bi = _mm256_blendv_epi8 (bi, iv, gt);
+		iv = _mm256_add_epi32 (iv, step);
+	}
+
+	m = _mm256_max_epi32 (bv, _mm256_permute2x128_si256 (bv, bv, 1));
+	m = _mm256_max_epi32 (m, _mm256_shuffle_epi32 (m, _MM_SHUFFLE (1, 0, 3, 2)));
+	m = _mm256_max_epi32 (m, _mm256_shuffle_epi32 (m, _MM_SHUFFLE (2, 3, 0, 1)));
+
+	bi = _mm256_blendv_epi8 (_mm256_set1_epi32 (INT32_MAX), bi, _mm256_cmpeq_epi32 (bv, m));
+	bi = _mm256_min_epi32 (bi, _mm256_permute2x128_si256 (bi, bi, 1));
+	bi = _mm256_min_epi32 (bi, _mm256_shuffle_epi32 (bi, _MM_SHUFFLE (1, 0, 3, 2)));
+	bi = _mm256_min_epi32 (bi, _mm256_shuffle_epi32 (bi, _MM_SHUFFLE (2, 3, 0, 1)));
+
+	best = _mm256_cvtsi256_si32 (bi);
+
+	/* No lane took a node only if every score is 0, node 0 wins the tie. */
+	return best == INT32_MAX ? 0 : best;
+}
+
+/** Seeds and, if replicas differ, weights of the nodes of snapshot $r. */
+static int _hrw_build (struct chash_root *ch, struct ring_t *r)
+{
+	int i, weighted = 0, wmax = 0;
+	char *ipaddr;
+
+	/* Padded to a whole AVX2 register, the padding is never scored. */
+	r->hrw_seed = (uint32_t *) ring_alloc (sizeof (uint32_t) * (ORYX_ALIGN (r->nns, 8) + 8));
+	if (unlikely (!r->hrw_seed))
+		return -1;
+	memset (r->hrw_seed, 0, sizeof (uint32_t) * (ORYX_ALIGN (r->nns, 8) + 8));
+
+	for (i = 0; i < r->nns; i ++) {
+		ipaddr = r->nodes[i]->ipaddr;
+		r->hrw_seed[i] = _hrw_fold (ch->hash_func (ipaddr, strlen (ipaddr)));
+		if (r->nodes[i]->replicas != r->nodes[0]->replicas)
+			weighted = 1;
+		wmax = MAX (wmax, r->nodes[i]->replicas);
+	}
+
+	/* If no node has replicas, they are all equal. */
+	if (!weighted || wmax <= 0)
+		return 0;
+
+	r->hrw_weight = (double *) malloc (sizeof (double) * (r->nns + 1));
+	if (unlikely (!r->hrw_weight))
+		return -1;
+
+	for (i = 0; i < r->nns; i ++)
+		r->hrw_weight[i] = (double)MAX (r->nodes[i]->replicas, 0);
+
+	return 0;
+}
+
+static int _hrw_lookup (const struct ring_t *r, ring_key_t hv)
+{
+	int i, best = 0;
+	uint32_t k = _hrw_fold (hv);
+	double s, bs = -1;
+
+	if (likely (!r->hrw_weight))
+		return hrw_argmax (r->hrw_seed, r->nns, k);
+
+	for (i = 0; i < r->nns; i ++) {
+		s = _hrw_wscore (r->hrw_weight[i], _hrw_score (r->hrw_seed[i], k));
+		if (s > bs) {
+			bs = s;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+/** Top $n nodes of $hv, highest score first, by insertion into $idx. O(N n). */
+static int _hrw_lookup_replicas (const struct ring_t *r, ring_key_t hv, int n, int *idx)
+{
+	int i, j, m = 0;
+	uint32_t k = _hrw_fold (hv), h;
+	double s, top[NODE_REPLICAS_MAX];
+
+	n = MIN (MIN (n, r->nns), NODE_REPLICAS_MAX);
+	if (unlikely (n <= 0))
+		return 0;
+
+	for (i = 0; i < r->nns; i ++) {
+		h = _hrw_score (r->hrw_seed[i], k);
+		s = r->hrw_weight ? _hrw_wscore (r->hrw_weight[i], h) : (double)h;
+
+		if (m == n && s <= top[m - 1])
+			continue;
+
+		for (j = (m < n) ? m ++ : m - 1; j > 0 && top[j - 1] < s; j --) {
+			top[j] = top[j - 1];
+			idx[j] = idx[j - 1];
+		}
+		top[j] = s;
+		idx[j] = i;
+	}
+
+	return m;
+}
+
+/** Rendezvous hashing engine, nodes are weighted by replicas but have no virtual nodes. */
+const struct chash_engine_t chash_engine_hrw = {
+	.name = "hrw",
+	.vn_grow = NULL,
+	.vn_shrink = NULL,
+	.lookup = _hrw_lookup,
+	.lookup_replicas = _hrw_lookup_replicas,
+	.build = _hrw_build,
+	.weighted = 1,
+};
+
+/** Select a scoring kernel for this CPU, once at startup. */
+__attribute__((constructor))
+static void hrw_init (void)
+{
+	__builtin_cpu_init ();
+
+	if (__builtin_cpu_supports ("avx2")) {
+		hrw_argmax = _hrw_argmax_avx2;
+		hrw_isa = "avx2";
+	}
+	else {
+		hrw_argmax = _hrw_argmax_scalar;
+		hrw_isa = "scalar";
+	}
+}
+
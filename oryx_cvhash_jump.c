@@ -0,0 +1,57 @@
+/*
+ *   oryx_cvhash_jump.c
+ *   Func: Jump consistent hash engine, for numbered shards which are only appended
+ *   Personal.Q
+ */
+
+#include "oryx.h"
+#include "oryx_rbtree.h"
+#include "oryx_list.h"
+#include "oryx_ipc.h"
+#include "oryx_cvhash.h"
+#include "oryx_cvhash_ring.h"
+
+/*
+  * Jump consistent hash (Lamping & Veach). A key jumps forward through the
+  * buckets 0 .. n - 1 with a pseudo random sequence seeded by the key, and the
+  * last bucket it lands on before jumping past n is its owner. Going from n
+  * to n + 1 buckets moves 1 / (n + 1) of the keys, all of them to the new one.
+  *
+  * Bucket b is the real node instance of compact index b, so buckets are the
+  * nodes in the order they were installed. There is no virtual node and no
+  * memory but the node array of the snapshot, lookups are O(ln n).
+  * Removing any node but the last one renumbers the nodes after it, and
+  * moves their keys as well, so shards should only ever be appended.
+  */
+
+/** Bucket in [0, $n) of $key, $n must be greater than 0. */
+static __oryx_always_inline__
+int _jump_bucket (uint64_t key, int n)
+{
+	int64_t b = -1, j = 0;
+
+	while (j < n) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (int64_t)((double)(b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+	}
+
+	return (int)b;
+}
+
+static int _jump_lookup (const struct ring_t *r, ring_key_t hv)
+{
+	return _jump_bucket ((uint64_t)hv, r->nns);
+}
+
+/** Jump consistent hash engine, no virtual nodes so replicas and weights are ignored. */
+const struct chash_engine_t chash_engine_jump = {
+	.name = "jump",
+	.vn_grow = NULL,
+	.vn_shrink = NULL,
+	.lookup = _jump_lookup,
+	.lookup_replicas = NULL,
+	.build = NULL,
+	.weighted = 0,
+};
+
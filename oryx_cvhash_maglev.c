@@ -0,0 +1,131 @@
+/*
+ *   oryx_cvhash_maglev.c
+ *   Func: Maglev lookup table engine, constant time lookups in a fixed memory budget
+ *   Personal.Q
+ */
+
+#include "oryx.h"
+#include "oryx_rbtree.h"
+#include "oryx_list.h"
+#include "oryx_ipc.h"
+#include "oryx_cvhash.h"
+#include "oryx_cvhash_ring.h"
+
+/*
+  * Maglev hashing (Eisenbud et al., NSDI 2016). Every node has a permutation of
+  * the M entries of a prime sized table, (offset + j * skip) mod M, and nodes take
+  * turns claiming their next preferred entry still free until the table is full.
+  * A lookup is a single table load. Each node ends up with M / N entries give or
+  * take one, and a membership change moves little more than the minimal share.
+  *
+  * Nodes are weighted by node_t.replicas. Per round, a node takes replicas / max
+  * turns, so a node with twice the replicas claims about twice the entries.
+  * The table is repopulated whenever a snapshot is published, so a chash_build
+  * or a chash_txn pays for a single repopulation, O(M log M) at worst.
+  */
+
+/*
+  * Maglev permutation structure definnition.
+  * Population state of a node.
+  */
+struct maglev_perm_t {
+
+	uint32_t next;	/** Next preferred entry, offset + j * skip mod M. */
+
+	uint32_t skip;	/** Step of the permutation, 1 .. M - 1 so that all entries are visited. */
+
+	int64_t credit;	/** Turns earned, a turn costs the largest weight. */
+
+	int weight;
+};
+
+/** Smallest prime not less than $n. */
+static uint32_t _maglev_prime (uint32_t n)
+{
+	uint32_t d;
+
+	for (n = MAX (n, 2); ; n ++) {
+		for (d = 2; d * d <= n && n % d; d ++);
+		if (d * d > n)
+			return n;
+	}
+}
+
+/** Populate the lookup table of snapshot $r from its nodes, in their compact index order. */
+static int _maglev_build (struct chash_root *ch, struct ring_t *r)
+{
+	int i, wmax = 0;
+	uint32_t m, filled = 0;
+	char key[64];
+	struct maglev_perm_t *perm, *p;
+
+	m = _maglev_prime (ch->table_size > 0 ?
+			MIN (ch->table_size, MAGLEV_TABLE_SIZE_MAX) : MAGLEV_TABLE_SIZE);
+
+	r->table = (uint32_t *) malloc (sizeof (uint32_t) * m);
+	perm = (struct maglev_perm_t *) malloc (sizeof (struct maglev_perm_t) * (r->nns + 1));
+	if (unlikely (!r->table || !perm)) {
+		free (perm);
+		return -1;
+	}
+
+	r->table_size = (int)m;
+	memset (r->table, 0xFF, sizeof (uint32_t) * m);
+
+	for (i = 0; i < r->nns; i ++)
+		wmax = MAX (wmax, r->nodes[i]->replicas);
+
+	/* Two independent hashes of the node name seed its permutation. */
+	for (i = 0; i < r->nns; i ++) {
+		p = &perm[i];
+		p->next = (uint32_t)(ch->hash_func (r->nodes[i]->ipaddr, strlen (r->nodes[i]->ipaddr)) % m);
+		snprintf (key, sizeof (key), "%s#skip", r->nodes[i]->ipaddr);
+		p->skip = (uint32_t)(ch->hash_func (key, strlen (key)) % (m - 1)) + 1;
+		p->credit = 0;
+		/* If no node has replicas, they are all equal. */
+		p->weight = wmax > 0 ? MAX (r->nodes[i]->replicas, 0) : 1;
+	}
+	wmax = MAX (wmax, 1);
+
+	while (r->nns && filled < m) {
+		for (i = 0; i < r->nns && filled < m; i ++) {
+			p = &perm[i];
+			for (p->credit += p->weight; p->credit >= wmax && filled < m; p->credit -= wmax) {
+				while (r->table[p->next] != (uint32_t)-1) {
+					p->next += p->skip;
+					if (p->next >= m)
+						p->next -= m;
+				}
+				r->table[p->next] = (uint32_t)i;
+				filled ++;
+			}
+		}
+	}
+
+	free (perm);
+
+	return 0;
+}
+
+/** Entry of $hv, the multiply-shift maps the key space onto M equal ranges without a division.
+	Hash values of every algorithm span the whole key space (see KETAMA_KEY), vchash -H shows the spread. */
+static int _maglev_lookup (const struct ring_t *r, ring_key_t hv)
+{
+#ifdef CHASH_RING64
+	return (int)r->table[(uint64_t)(((unsigned __int128)hv * (uint32_t)r->table_size) >> 64)];
+#else
+	return (int)r->table[(uint32_t)(((uint64_t)hv * (uint32_t)r->table_size) >> 32)];
+#endif
+}
+
+/** Maglev lookup table engine, nodes are weighted by replicas but have no virtual nodes. */
+const struct chash_engine_t chash_engine_maglev = {
+	.name = "maglev",
+	.vn_grow = NULL,
+	.vn_shrink = NULL,
+	.lookup = _maglev_lookup,
+	.lookup_replicas = NULL,
+	.build = _maglev_build,
+	.weighted = 1,
+};
+
@@ -0,0 +1,233 @@
+/*
+ *   oryx_cvhash_migrate.c
+ *   Func: Migration planner, throttled move tasks for a membership change
+ *   Personal.Q
+ */
+
+#include "oryx.h"
+#include "oryx_rbtree.h"
+#include "oryx_list.h"
+#include "oryx_ipc.h"
+#include "oryx_cvhash.h"
+#include "oryx_cvhash_ring.h"
+#include "oryx_cvhash_diff.h"
+#include "oryx_cvhash_migrate.h"
+
+/** Order arcs by (source, target) machine, then by start. */
+static int _arc_cmp (const void *a, const void *b)
+{
+	const struct ring_arc_t *x = (const struct ring_arc_t *)a, *y = (const struct ring_arc_t *)b;
+	int r;
+
+	if (0 != (r = strcmp (x->old_node->ipaddr, y->old_node->ipaddr)))
+		return r;
+	if (0 != (r = strcmp (x->new_node->ipaddr, y->new_node->ipaddr)))
+		return r;
+
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+/** Order pairs by round, then by descending keys so that the largest transfers start first. */
+static int _pair_cmp (const void *a, const void *b)
+{
+	const struct migrate_pair_t *x = (const struct migrate_pair_t *)a, *y = (const struct migrate_pair_t *)b;
+
+	if (x->round != y->round)
+		return (x->round > y->round) - (x->round < y->round);
+
+	return (x->keys < y->keys) - (x->keys > y->keys);
+}
+
+static int _str_cmp (const void *a, const void *b)
+{
+	return strcmp (*(char * const *)a, *(char * const *)b);
+}
+
+/** Machine id of $ipaddr within the sorted unique $names. */
+static int _machine_id (char **names, int n, const char *ipaddr)
+{
+	int lo = 0, hi = n - 1, m, c;
+
+	while (lo <= hi) {
+		m = (lo + hi) / 2;
+		c = strcmp (names[m], ipaddr);
+		if (!c)
+			return m;
+		if (c < 0)
+			lo = m + 1;
+		else
+			hi = m - 1;
+	}
+
+	return -1;
+}
+
+/** Pack pairs into rounds, largest first, each into the earliest round where
+	neither its source nor its target has reached $max pairs. */
+static int _migrate_schedule (struct migrate_plan_t *p)
+{
+	int i, r, left = p->npairs, *load;
+
+	load = (int *) malloc (sizeof (int) * (p->nmachines + 1));
+	if (unlikely (!load))
+		return -1;
+
+	/* Largest first, so that they are not all left to the last round. */
+	for (i = 0; i < p->npairs; i ++)
+		p->pairs[i].round = 0;
+	qsort (p->pairs, p->npairs, sizeof (struct migrate_pair_t), _pair_cmp);
+
+	for (i = 0; i < p->npairs; i ++)
+		p->pairs[i].round = -1;
+
+	for (r = 0; left; r ++) {
+		memset (load, 0, sizeof (int) * p->nmachines);
+		for (i = 0; i < p->npairs; i ++) {
+			if (p->pairs[i].round >= 0)
+				continue;
+			if (p->max_per_node > 0 && (load[p->pairs[i].src] >= p->max_per_node ||
+					load[p->pairs[i].dst] >= p->max_per_node))
+				continue;
+			p->pairs[i].round = r;
+			load[p->pairs[i].src] ++;
+			load[p->pairs[i].dst] ++;
+			left --;
+		}
+	}
+
+	p->nrounds = r;
+	qsort (p->pairs, p->npairs, sizeof (struct migrate_pair_t), _pair_cmp);
+
+	free (load);
+
+	return 0;
+}
+
+/** Plan the migration from the ring of $o to the ring of $n, e.g. a chcopy taken
+	before node_install or node_remove, and the root after it. Arcs which changed
+	owner (chash_diff) are grouped per (source, target) pair and pairs are packed
+	into rounds of at most $max_per_node concurrent pairs per machine, 0 for no limit.
+	Keys of an empty ring have no source or no target and are left out.
+	Tasks refer to nodes of both rings, which must not be freed while in use.
+	Returns NULL if out of memory or the rings can not be diffed, see ring_diff. */
+struct migrate_plan_t *migrate_plan (struct chash_root *o, struct chash_root *n, int max_per_node)
+{
+	int i, j, nnames = 0;
+	char **names = NULL;
+	struct migrate_plan_t *p;
+	struct migrate_pair_t *pr = NULL;
+
+	p = (struct migrate_plan_t *) malloc (sizeof (struct migrate_plan_t));
+	if (unlikely (!p))
+		return NULL;
+
+	memset (p, 0, sizeof (struct migrate_plan_t));
+	p->max_per_node = max_per_node;
+
+	p->narcs = chash_diff (o, n, &p->arcs, &p->moved);
+	if (unlikely (p->narcs < 0)) {
+		p->arcs = NULL;
+		goto fail;
+	}
+
+	/* Nothing can be copied from or to an empty ring. */
+	for (i = 0, j = 0; i < p->narcs; i ++) {
+		if (p->arcs[i].old_node && p->arcs[i].new_node)
+			p->arcs[j ++] = p->arcs[i];
+	}
+	p->narcs = j;
+
+	qsort (p->arcs, p->narcs, sizeof (struct ring_arc_t), _arc_cmp);
+
+	/* Machines, by ipaddr. */
+	names = (char **) malloc (sizeof (char *) * (p->narcs * 2 + 1));
+	p->pairs = (struct migrate_pair_t *) malloc (sizeof (struct migrate_pair_t) * (p->narcs + 1));
+	if (unlikely (!names || !p->pairs))
+		goto fail;
+
+	for (i = 0; i < p->narcs; i ++) {
+		names[nnames ++] = p->arcs[i].old_node->ipaddr;
+		names[nnames ++] = p->arcs[i].new_node->ipaddr;
+	}
+	qsort (names, nnames, sizeof (char *), _str_cmp);
+	for (i = 0, j = 0; i < nnames; i ++) {
+		if (!j || strcmp (names[j - 1], names[i]))
+			names[j ++] = names[i];
+	}
+	p->nmachines = nnames = j;
+
+	/* Pairs are runs of arcs with the same source and target. */
+	for (i = 0; i < p->narcs; i ++) {
+		if (i && !strcmp (p->arcs[i].old_node->ipaddr, p->arcs[i - 1].old_node->ipaddr) &&
+				!strcmp (p->arcs[i].new_node->ipaddr, p->arcs[i - 1].new_node->ipaddr)) {
+			pr->narcs ++;
+			pr->keys += ring_arc_keys (&p->arcs[i]);
+			continue;
+		}
+
+		pr = &p->pairs[p->npairs ++];
+		pr->first = i;
+		pr->narcs = 1;
+		pr->keys = ring_arc_keys (&p->arcs[i]);
+		pr->src = _machine_id (names, nnames, p->arcs[i].old_node->ipaddr);
+		pr->dst = _machine_id (names, nnames, p->arcs[i].new_node->ipaddr);
+	}
+
+	if (unlikely (_migrate_schedule (p)))
+		goto fail;
+
+	free (names);
+
+	return p;
+
+fail:
+	free (names);
+	migrate_plan_free (p);
+
+	return NULL;
+}
+
+/** Next task of plan $p, in round order, all tasks of a pair back to back.
+	Returns 0 and fills $t, or -1 once the plan is exhausted. */
+int migrate_next (struct migrate_plan_t *p, struct migrate_task_t *t)
+{
+	struct migrate_pair_t *pr;
+	struct ring_arc_t *a;
+
+	if (p->pair >= p->npairs)
+		return -1;
+
+	pr = &p->pairs[p->pair];
+	a = &p->arcs[pr->first + p->arc];
+
+	t->start = a->start;
+	t->end = a->end;
+	t->src = a->old_node;
+	t->dst = a->new_node;
+	t->round = pr->round;
+
+	if (++ p->arc == pr->narcs) {
+		p->arc = 0;
+		p->pair ++;
+	}
+
+	return 0;
+}
+
+/** Restart the iterator of plan $p from its first task. */
+void migrate_rewind (struct migrate_plan_t *p)
+{
+	p->pair = 0;
+	p->arc = 0;
+}
+
+void migrate_plan_free (struct migrate_plan_t *p)
+{
+	if (unlikely (!p))
+		return;
+
+	free (p->arcs);
+	free (p->pairs);
+	free (p);
+}
+
@@ -0,0 +1,81 @@
+/*
+ *   oryx_cvhash_migrate.h
+ *   Func: Migration planner, throttled move tasks for a membership change
+ *   Personal.Q
+ */
+
+
+#ifndef __ORYX_CVHASH_MIGRATE_H__
+#define __ORYX_CVHASH_MIGRATE_H__
+
+/*
+  * Migration task structure definnition.
+  * Keys start .. end (both inclusive) must be copied from $src to $dst.
+  */
+struct migrate_task_t {
+
+	ring_key_t start;
+
+	ring_key_t end;
+
+	struct node_t *src;	/** Owner in the old ring. */
+
+	struct node_t *dst;	/** Owner in the new ring. */
+
+	int round;		/** Tasks of the same round may run at once, rounds run one after another. */
+};
+
+/*
+  * Migration pair structure definnition.
+  * All tasks from one source to one target, they are streamed back to back.
+  */
+struct migrate_pair_t {
+
+	int first;		/** First arc of the pair within migrate_plan_t->arcs. */
+
+	int narcs;
+
+	double keys;	/** Keys moved by the pair. */
+
+	int src, dst;	/** Machine ids, see migrate_plan_t. */
+
+	int round;
+};
+
+/*
+  * Migration plan structure definnition.
+  * Arcs which changed owner, grouped per (source, target) pair. Pairs are packed
+  * into rounds so that no machine takes part in more than $max_per_node pairs
+  * of a round, as a source or as a target. Machines are identified by ipaddr,
+  * so that a machine of the old ring and the same one of the new ring are one.
+  */
+struct migrate_plan_t {
+
+	struct ring_arc_t *arcs;	/** Sorted by pair, then by start. */
+
+	int narcs;
+
+	struct migrate_pair_t *pairs;	/** Ascending round, descending keys within a round. */
+
+	int npairs;
+
+	int nmachines;	/** Count of distinct machines taking part. */
+
+	int nrounds;
+
+	int max_per_node;	/** Concurrent pairs a machine may take part in, 0 for no limit. */
+
+	double moved;	/** Fraction of the key space which changed owner. */
+
+	int pair;		/** Iterator, current pair. */
+
+	int arc;		/** Iterator, next arc within the current pair. */
+};
+
+extern struct migrate_plan_t *migrate_plan (struct chash_root *o, struct chash_root *n, int max_per_node);
+extern int migrate_next (struct migrate_plan_t *p, struct migrate_task_t *t);
+extern void migrate_rewind (struct migrate_plan_t *p);
+extern void migrate_plan_free (struct migrate_plan_t *p);
+
+#endif
+
@@ -0,0 +1,181 @@
+/*
+ *   oryx_cvhash_ring.c
+ *   Func: Immutable flat ring snapshot for fast consistent hash lookup
+ *   Personal.Q
+ */
+
+#include "oryx.h"
+#include "oryx_rbtree.h"
+#include "oryx_list.h"
+#include "oryx_ipc.h"
+#include "oryx_cvhash.h"
+#include "oryx_cvhash_ring.h"
+#include "oryx_cvhash_epoch.h"
+
+/** Alignment of position arrays, a cache line. */
+#define RING_ALIGN	64
+
+/** Allocate a cache line aligned array for a ring snapshot. */
+void *ring_alloc (size_t s)
+{
+	void *p = NULL;
+
+	if (posix_memalign (&p, RING_ALIGN, ORYX_ALIGN (s, RING_ALIGN)))
+		return NULL;
+
+	return p;
+}
+
+/** Free a ring snapshot. */
+void ring_free (struct ring_t *r)
+{
+	if (unlikely (!r))
+		return;
+
+	free (r->pos);
+	free (r->idx);
+	free (r->nodes);
+	free (r->stree);
+	free (r->sidx);
+	free (r->eytz);
+	free (r->eidx);
+	free (r->bkt);
+	free (r->vhits);
+	free (r->succ);
+	free (r->table);
+	free (r->hrw_seed);
+	free (r->hrw_weight);
+	free (r);
+}
+
+static void _ring_free (void *p)
+{
+	ring_free ((struct ring_t *)p);
+}
+
+/** Build the successor table of $r with $k distinct nodes per slot, in O(V k).
+	Slots are visited counterclockwise over two laps, the list of a slot is its own
+	node followed by the list of the next slot without it, so that the lists of the
+	last slots see past the wraparound in the second lap. */
+static int _ring_succ_build (struct ring_t *r, int k)
+{
+	int i, j, m, s;
+	uint32_t *cur, *nxt;
+
+	k = MIN (k, NODE_REPLICAS_MAX);
+	if (k <= 0 || !r->nvns)
+		return 0;
+
+	r->succ = (uint32_t *) ring_alloc (sizeof (uint32_t) * r->nvns * k);
+	if (unlikely (!r->succ))
+		return -1;
+
+	r->nsucc = k;
+	memset (r->succ, 0xFF, sizeof (uint32_t) * r->nvns * k);
+
+	for (i = 2 * r->nvns - 1; i >= 0; i --) {
+		s = i % r->nvns;
+		cur = &r->succ[s * k];
+		nxt = &r->succ[((s + 1) % r->nvns) * k];
+
+		cur[0] = r->idx[s];
+		for (j = 0, m = 1; j < k && m < k && nxt[j] != UINT32_MAX; j ++) {
+			if (nxt[j] != r->idx[s])
+				cur[m ++] = nxt[j];
+		}
+		while (m < k)
+			cur[m ++] = UINT32_MAX;
+	}
+
+	return 0;
+}
+
+/** Build a flat ring snapshot from the virtual node RB root of $ch.
+	Each real node instance is assigned a compact index (n->id) which is
+	only meaningful within the returned snapshot. */
+struct ring_t *ring_build (struct chash_root *ch)
+{
+	int i = 0, nvns = 0, nns = 0;
+	struct rb_node *rbn;
+	struct vnode_t *vn;
+	struct node_t *n1 = NULL, *p;
+	struct ring_t *r;
+
+	r = (struct ring_t *) malloc (sizeof (struct ring_t));
+	if (unlikely (!r))
+		return NULL;
+
+	memset (r, 0, sizeof (struct ring_t));
+	r->engine = ch->engine;
+
+	oryx_thread_mutex_lock (&ch->nhlock);
+
+	list_for_each_entry_safe (n1, p, &ch->node_head, node) {
+		nvns += n1->valid_vns;
+		nns ++;
+	}
+
+	r->nodes = (struct node_t **) malloc (sizeof (struct node_t *) * (nns + 1));
+	r->pos = (ring_key_t *) ring_alloc (sizeof (ring_key_t) * (nvns + 1));
+	r->idx = (uint32_t *) ring_alloc (sizeof (uint32_t) * (nvns + 1));
+	if (ch->vn_hits)
+		r->vhits = (struct hits_t **) malloc (sizeof (struct hits_t *) * (nvns + 1));
+	if (unlikely (!r->nodes || !r->pos || !r->idx || (ch->vn_hits && !r->vhits))) {
+		oryx_thread_mutex_unlock (&ch->nhlock);
+		ring_free (r);
+		return NULL;
+	}
+
+	list_for_each_entry_safe (n1, p, &ch->node_head, node) {
+		n1->id = i;
+		r->nodes[i ++] = n1;
+	}
+	r->nns = nns;
+
+	oryx_thread_mutex_unlock (&ch->nhlock);
+
+	/* In-order travel of vn_root gives ascending positions. */
+	i = 0;
+	for (rbn = rb_first (&ch->vn_root); rbn && i < nvns; rbn = rb_next (rbn)) {
+		vn = rb_entry (rbn, struct vnode_t, node);
+		r->pos[i] = VN_KEY_I(vn);
+		r->idx[i] = ((struct node_t *)vn->physical_node)->id;
+		if (r->vhits)
+			r->vhits[i] = vn->hits;
+		i ++;
+	}
+	r->nvns = i;
+
+	if (unlikely (ring_layout_build (r, ch->ring_layout) ||
+			ring_bucket_build (r, ch->ring_bucket_bits) ||
+			_ring_succ_build (r, ch->ring_replicas) ||
+			(r->engine->build && r->engine->build (ch, r)))) {
+		ring_free (r);
+		return NULL;
+	}
+
+	return r;
+}
+
+/** Rebuild the ring snapshot of $ch and replace the old one with an atomic
+	pointer swap. Readers of the old one keep using it, it is freed once they
+	have all left their read sections (see oryx_cvhash_epoch.c).
+	Should be called after every change of vn_root, with ch->wrlock held.
+	Returns 0, or -1 if out of memory. The stale snapshot is then kept and may
+	still hold nodes unlinked since, so the caller must not hand them back for
+	freeing, see node_remove. */
+int ring_publish (struct chash_root *ch)
+{
+	struct ring_t *r, *old;
+
+	r = ring_build (ch);
+	if (unlikely (!r))
+		return -1;
+
+	old = __atomic_exchange_n (&ch->ring, r, __ATOMIC_SEQ_CST);
+	if (old)
+		epoch_retire (old, _ring_free);
+
+	return 0;
+}
+
@@ -0,0 +1,171 @@
+/*
+ *   oryx_cvhash_ring.h
+ *   Func: Immutable flat ring snapshot for fast consistent hash lookup
+ *   Personal.Q
+ */
+
+
+#ifndef __ORYX_CVHASH_RING_H__
+#define __ORYX_CVHASH_RING_H__
+
+/** Keys per S-tree block, a cache line (16 x 32 bit or 8 x 64 bit keys). */
+#define RING_STREE_B	(64 / (int)sizeof (ring_key_t))
+
+/** Eytzinger prefetch distance in elements, a cache line of descendants,
+	4 levels ahead for 32 bit keys and 3 levels ahead for 64 bit keys. */
+#define RING_EYTZ_PREFETCH	(64 / (int)sizeof (ring_key_t))
+
+/** Count of searches interleaved by ring_find_slots. */
+#define RING_BATCH	16
+
+/** Upper limit of chash_root->ring_bucket_bits, a 2^24 entries table is 64MB. */
+#define RING_BUCKET_BITS_MAX	24
+
+/** Search layouts of a ring snapshot, see chash_root->ring_layout. */
+enum {
+	RING_LAYOUT_STREE,		/** Static B-tree, SIMD ranked. Default. */
+	RING_LAYOUT_EYTZINGER,	/** BFS ordered binary tree with software prefetch,
+								for rings which do not fit in L2. */
+	RING_LAYOUT_FLAT,		/** Plain sorted array, branchless lower_bound. */
+};
+
+/*
+  * Flat ring snapshot structure definnition.
+  * A read-only copy of chash_root->vn_root, built after each membership change.
+  * Positions are kept sorted in a contiguous array so that a lookup is a plain
+  * lower_bound over cache friendly memory instead of a pointer chasing tree walk.
+  */
+struct ring_t {
+
+	ring_key_t *pos;		/** Sorted virtual node positions (keys), ascending. */
+
+	uint32_t *idx;		/** Parallel array, compact physical node index of pos[i]. */
+
+	struct node_t **nodes;	/** Compact index to real node instance. */
+
+	int nvns;		/** Count of virtual nodes (entries of pos & idx). */
+
+	int nns;		/** Count of real node instances (entries of nodes). */
+
+	ring_key_t *stree;	/** Positions in S-tree (static B-tree) layout, see oryx_cvhash_search.c. */
+
+	uint32_t *sidx;		/** Parallel array, slot within pos[] of each stree[] entry. */
+
+	int nblocks;	/** Count of S-tree blocks, each has RING_STREE_B entries. */
+
+	ring_key_t *eytz;		/** Positions in Eytzinger (BFS) order, 1-based, eytz[0] unused. */
+
+	uint32_t *eidx;		/** Parallel array, slot within pos[] of each eytz[] entry. */
+
+	int layout;		/** RING_LAYOUT_XXX this snapshot was built with. */
+
+	int (*search) (const struct ring_t *r, ring_key_t hv);	/** Successor search kernel for $layout.
+								Returns the first slot whose position is not less than $hv, or nvns. */
+
+	void (*search_batch) (const struct ring_t *r, const ring_key_t *hv, int n, int *slot);	/** Interleaved
+								$search for up to RING_BATCH hash values. */
+
+	uint32_t *bkt;		/** Optional prefix bucket index, 2^k + 1 entries. bkt[b] is the first slot
+								whose position is not less than (b << bkt_shift), bkt[2^k] is nvns. */
+
+	int bkt_shift;	/** RING_KEY_BITS - k, where k is the count of top bits of a hash value indexing bkt[]. */
+
+	struct hits_t **vhits;	/** Parallel array, hit counters of the virtual node of pos[i].
+									Only built if chash_root->vn_hits is set. */
+
+	uint32_t *succ;	/** Optional successor table, nsucc entries per slot. succ[i * nsucc + j] is the
+								compact index of the j-th distinct node clockwise from pos[i] (j = 0 is idx[i]),
+								UINT32_MAX past the last one if there are less than nsucc nodes. */
+
+	int nsucc;		/** Distinct nodes per slot of succ, chash_root->ring_replicas. */
+
+	const struct chash_engine_t *engine;	/** chash_root->engine this snapshot was built with,
+												pos & idx are empty unless it is &chash_engine_ring. */
+
+	uint32_t *table;	/** Lookup table of a table engine (Maglev), compact node index of each entry. */
+
+	int table_size;	/** Entries of table, a prime. */
+
+	uint32_t *hrw_seed;	/** Score seed of each node of a HRW engine, padded to a multiple of 8. */
+
+	double *hrw_weight;	/** Weight of each node of a HRW engine, NULL if all weigh the same. */
+};
+
+/** S-tree search kernel selected at startup (AVX2, SSE4.2 or scalar). */
+extern int (*ring_stree_search) (const struct ring_t *r, ring_key_t hv);
+extern void (*ring_stree_search_batch) (const struct ring_t *r, const ring_key_t *hv, int n, int *slot);
+extern const char *ring_search_isa;
+
+/** Branchless lower_bound, returns the first slot whose position is not less than $hv,
+	or $n if there is no such a slot. $n must be greater than 0. */
+static __oryx_always_inline__
+int ring_lower_bound (const ring_key_t *pos, int n, ring_key_t hv)
+{
+	const ring_key_t *base = pos;
+	int half;
+
+	while (n > 1) {
+		half = n >> 1;
+		base = (base[half] < hv) ? base + half : base;
+		n -= half;
+	}
+
+	return (int)(base - pos) + (*base < hv);
+}
+
+/** Prefix bucket search, one table load and a lower_bound over the few
+	positions sharing the top k bits with $hv. Positions are uniform hash values,
+	so a bucket holds about nvns / 2^k of them. */
+static __oryx_always_inline__
+int ring_bucket_search (const struct ring_t *r, ring_key_t hv)
+{
+	const uint32_t *b = &r->bkt[hv >> r->bkt_shift];
+	int i = b[0], n = b[1] - b[0];
+
+	return n ? i + ring_lower_bound (r->pos + i, n, hv) : i;
+}
+
+/** Find a ring slot who's position is nearest by $hv at clockwise.
+	The first slot (minimum key, same as vn_min) is used when wrapping around. */
+static __oryx_always_inline__
+int ring_find_slot (const struct ring_t *r, ring_key_t hv)
+{
+	int i = r->bkt ? ring_bucket_search (r, hv) : r->search (r, hv);
+
+	return (i == r->nvns) ? 0 : i;
+}
+
+/** Find a real node instance with a hash value $hv. */
+static __oryx_always_inline__
+struct node_t *ring_find (const struct ring_t *r, ring_key_t hv)
+{
+	if (unlikely (!r))
+		return NULL;
+
+	if (unlikely (r->engine->lookup))
+		return r->nns ? r->nodes[r->engine->lookup (r, hv)] : NULL;
+
+	if (unlikely (!r->nvns))
+		return NULL;
+
+	return r->nodes[r->idx[ring_find_slot (r, hv)]];
+}
+
+/** Current ring snapshot of $ch, must be called within a read section
+	(epoch_read_lock) and the snapshot must not be used after leaving it. */
+static __oryx_always_inline__
+struct ring_t *ring_deref (struct chash_root *ch)
+{
+	return __atomic_load_n (&ch->ring, __ATOMIC_ACQUIRE);
+}
+
+extern struct ring_t *ring_build (struct chash_root *ch);
+extern void ring_free (struct ring_t *r);
+extern int ring_publish (struct chash_root *ch);
+extern void *ring_alloc (size_t s);
+extern int ring_layout_build (struct ring_t *r, int layout);
+extern int ring_bucket_build (struct ring_t *r, int bits);
+extern void ring_find_slots (const struct ring_t *r, const ring_key_t *hv, int n, int *slot);
+
+#endif
+
@@ -0,0 +1,414 @@
+/*
+ *   oryx_cvhash_search.c
+ *   Func: Ring search layouts & kernels (S-tree with SSE4.2/AVX2 dispatch, Eytzinger, flat)
+ *   Personal.Q
+ */
+
+#include "oryx.h"
+#include "oryx_rbtree.h"
+#include "oryx_list.h"
+#include "oryx_ipc.h"
+#include "oryx_cvhash.h"
+#include "oryx_cvhash_ring.h"
+
+#include <immintrin.h>
+
+/*
+  * Static B-tree (S-tree) layout.
+  * Sorted positions are regrouped into blocks of RING_STREE_B keys, one cache line each.
+  * Block $k has RING_STREE_B + 1 children, stored in BFS order, so that a lookup
+  * visits log17(V) blocks (log9(V) for 64 bit keys) and ranks $hv within a block by a single SIMD compare.
+  * Keys are stored with the sign bit flipped, SSE/AVX only have signed compares.
+  */
+#ifdef CHASH_RING64
+#define STREE_BIAS	0x8000000000000000ULL
+#else
+#define STREE_BIAS	0x80000000U
+#endif
+#define STREE_CHILD(k,i)	((k) * (RING_STREE_B + 1) + (i) + 1)
+
+int (*ring_stree_search) (const struct ring_t *r, ring_key_t hv);
+void (*ring_stree_search_batch) (const struct ring_t *r, const ring_key_t *hv, int n, int *slot);
+const char *ring_search_isa = "scalar";
+
+static void _stree_fill (struct ring_t *r, int k, int *t)
+{
+	int i;
+
+	if (k >= r->nblocks)
+		return;
+
+	for (i = 0; i < RING_STREE_B; i ++) {
+		_stree_fill (r, STREE_CHILD(k, i), t);
+		if (*t < r->nvns) {
+			r->stree[k * RING_STREE_B + i] = r->pos[*t] ^ STREE_BIAS;
+			r->sidx[k * RING_STREE_B + i] = *t;
+			(*t) ++;
+		} else {
+			/* Padding, never less than any key and points to nowhere. */
+			r->stree[k * RING_STREE_B + i] = (ring_key_t)~0ULL ^ STREE_BIAS;
+			r->sidx[k * RING_STREE_B + i] = r->nvns;
+		}
+	}
+
+	_stree_fill (r, STREE_CHILD(k, RING_STREE_B), t);
+}
+
+/*
+  * Eytzinger layout.
+  * eytz[k] has children eytz[2k] and eytz[2k+1]. The 16 descendants of eytz[k] four
+  * levels below are contiguous (eytz[16k .. 16k+15]), a single cache line of 32 bit
+  * keys, so it can be prefetched while the current level is still being compared.
+  * With 64 bit keys a cache line holds the 8 descendants three levels below.
+  */
+static void _eytz_fill (struct ring_t *r, int k, int *t)
+{
+	if (k > r->nvns)
+		return;
+
+	_eytz_fill (r, 2 * k, t);
+	r->eytz[k] = r->pos[*t];
+	r->eidx[k] = *t;
+	(*t) ++;
+	_eytz_fill (r, 2 * k + 1, t);
+}
+
+/** Scalar fallback, branchless lower_bound over the flat array. */
+static int _flat_search (const struct ring_t *r, ring_key_t hv)
+{
+	return ring_lower_bound (r->pos, r->nvns, hv);
+}
+
+/** The deepest block slot visited which is not less than $hv is the clockwise successor.
+	Blocks on the right of a padding slot are padding as well, so $sidx of
+	a padding slot (r->nvns) means "not found, wrap around". */
+#define STREE_SEARCH_BODY(rank_fn)\
+	int k = 0, i, res = -1;\
+	const ring_key_t x = hv ^ STREE_BIAS;\
+	while (k < r->nblocks) {\
+		i = rank_fn (&r->stree[k * RING_STREE_B], x);\
+		if (i < RING_STREE_B)\
+			res = k * RING_STREE_B + i;\
+		k = STREE_CHILD(k, i);\
+	}\
+	return (res < 0) ? r->nvns : (int)r->sidx[res];
+
+#ifdef CHASH_RING64
+/** Count of keys less than $x in a block of 8 x 64 bit keys, pcmpgtq is SSE4.2. */
+__attribute__((target("sse4.2,popcnt")))
+static __oryx_always_inline__
+int _rank_sse42 (const ring_key_t *block, ring_key_t x)
+{
+	const __m128i *b = (const __m128i *)block;
+	__m128i xv = _mm_set1_epi64x ((long long)x);
+	int m;
+
+	m  = _mm_movemask_pd (_mm_castsi128_pd (_mm_cmpgt_epi64 (xv, _mm_load_si128 (b + 0))));
+	m |= _mm_movemask_pd (_mm_castsi128_pd (_mm_cmpgt_epi64 (xv, _mm_load_si128 (b + 1)))) << 2;
+	m |= _mm_movemask_pd (_mm_castsi128_pd (_mm_cmpgt_epi64 (xv, _mm_load_si128 (b + 2)))) << 4;
+	m |= _mm_movemask_pd (_mm_castsi128_pd (_mm_cmpgt_epi64 (xv, _mm_load_si128 (b + 3)))) << 6;
+
+	return __builtin_popcount (m);
+}
+#else
+/** Count of keys less than $x in a block of 16 x 32 bit keys. */
+__attribute__((target("sse4.2,popcnt")))
+static __oryx_always_inline__
+int _rank_sse42 (const ring_key_t *block, ring_key_t x)
+{
+	const __m128i *b = (const __m128i *)block;
+	__m128i xv = _mm_set1_epi32 ((int)x);
+	int m;
+
+	m  = _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpgt_epi32 (xv, _mm_load_si128 (b + 0))));
+	m |= _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpgt_epi32 (xv, _mm_load_si128 (b + 1)))) << 4;
+	m |= _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpgt_epi32 (xv, _mm_load_si128 (b + 2)))) << 8;
+	m |= _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpgt_epi32 (xv, _mm_load_si128 (b + 3)))) << 12;
+
+	return __builtin_popcount (m);
+}
+#endif
+
+/** Interleaved S-tree searches, the child block of every in-flight search is
+	prefetched before any of them is ranked at the next level. */
+#define STREE_SEARCH_BATCH_BODY(rank_fn)\
+	int j, i, more = 1;\
+	int k[RING_BATCH], res[RING_BATCH];\
+	for (j = 0; j < n; j ++) {\
+		k[j] = 0;\
+		res[j] = -1;\
+	}\
+	while (more) {\
+		more = 0;\
+		for (j = 0; j < n; j ++) {\
+			if (k[j] >= r->nblocks)\
+				continue;\
+			i = rank_fn (&r->stree[k[j] * RING_STREE_B], hv[j] ^ STREE_BIAS);\
+			if (i < RING_STREE_B)\
+				res[j] = k[j] * RING_STREE_B + i;\
+			k[j] = STREE_CHILD(k[j], i);\
+			if (k[j] < r->nblocks) {\
+				__builtin_prefetch (&r->stree[k[j] * RING_STREE_B]);\
+				more = 1;\
+			}\
+		}\
+	}\
+	for (j = 0; j < n; j ++)\
+		slot[j] = (res[j] < 0) ? r->nvns : (int)r->sidx[res[j]];
+
+__attribute__((target("sse4.2,popcnt")))
+static int _stree_search_sse42 (const struct ring_t *r, ring_key_t hv)
+{
+	STREE_SEARCH_BODY(_rank_sse42)
+}
+
+__attribute__((target("sse4.2,popcnt")))
+static void _stree_search_batch_sse42 (const struct ring_t *r, const ring_key_t *hv, int n, int *slot)
+{
+	STREE_SEARCH_BATCH_BODY(_rank_sse42)
+}
+
+#ifdef CHASH_RING64
+__attribute__((target("avx2,popcnt")))
+static __oryx_always_inline__
+int _rank_avx2 (const ring_key_t *block, ring_key_t x)
+{
+	const __m256i *b = (const __m256i *)block;
+	__m256i xv = _mm256_set1_epi64x ((long long)x);
+	int m;
+
+	m  = _mm256_movemask_pd (_mm256_castsi256_pd (_mm256_cmpgt_epi64 (xv, _mm256_load_si256 (b + 0))));
+	m |= _mm256_movemask_pd (_mm256_castsi256_pd (_mm256_cmpgt_epi64 (xv, _mm256_load_si256 (b + 1)))) << 4;
+
+	return __builtin_popcount (m);
+}
+#else
+__attribute__((target("avx2,popcnt")))
+static __oryx_always_inline__
+int _rank_avx2 (const ring_key_t *block, ring_key_t x)
+{
+	const __m256i *b = (const __m256i *)block;
+	__m256i xv = _mm256_set1_epi32 ((int)x);
+	int m;
+
+	m  = _mm256_movemask_ps (_mm256_castsi256_ps (_mm256_cmpgt_epi32 (xv, _mm256_load_si256 (b + 0))));
+	m |= _mm256_movemask_ps (_mm256_castsi256_ps (_mm256_cmpgt_epi32 (xv, _mm256_load_si256 (b + 1)))) << 8;
+
+	return __builtin_popcount (m);
+}
+#endif
+
+__attribute__((target("avx2,popcnt")))
+static int _stree_search_avx2 (const struct ring_t *r, ring_key_t hv)
+{
+	STREE_SEARCH_BODY(_rank_avx2)
+}
+
+__attribute__((target("avx2,popcnt")))
+static void _stree_search_batch_avx2 (const struct ring_t *r, const ring_key_t *hv, int n, int *slot)
+{
+	STREE_SEARCH_BATCH_BODY(_rank_avx2)
+}
+
+/** Eytzinger search, a cache line of descendants is prefetched at each step.
+	Prefetch never faults, so reading ahead past the last level is fine. */
+static int _eytz_search (const struct ring_t *r, ring_key_t hv)
+{
+	const ring_key_t *e = r->eytz;
+	int k = 1;
+
+	while (k <= r->nvns) {
+		__builtin_prefetch (e + k * RING_EYTZ_PREFETCH);
+		k = 2 * k + (e[k] < hv);
+	}
+
+	/* Cancel the trailing right turns, the last left turn is the answer. */
+	k >>= __builtin_ffs (~k);
+
+	return k ? (int)r->eidx[k] : r->nvns;
+}
+
+/** Interleaved branchless lower_bound. All searches over the same array take
+	the same count of steps, so each step probes $n positions at once and
+	prefetches the next probe of every search. */
+static void _flat_search_batch (const struct ring_t *r, const ring_key_t *hv, int n, int *slot)
+{
+	int j, half, len = r->nvns;
+	const ring_key_t *base[RING_BATCH];
+
+	for (j = 0; j < n; j ++)
+		base[j] = r->pos;
+
+	while (len > 1) {
+		half = len >> 1;
+		for (j = 0; j < n; j ++) {
+			base[j] = (base[j][half] < hv[j]) ? base[j] + half : base[j];
+			__builtin_prefetch (base[j] + ((len - half) >> 1));
+		}
+		len -= half;
+	}
+
+	for (j = 0; j < n; j ++)
+		slot[j] = (int)(base[j] - r->pos) + (*base[j] < hv[j]);
+}
+
+/** Interleaved Eytzinger searches, same prefetch distance as _eytz_search. */
+static void _eytz_search_batch (const struct ring_t *r, const ring_key_t *hv, int n, int *slot)
+{
+	int j, more = 1;
+	int k[RING_BATCH];
+	const ring_key_t *e = r->eytz;
+
+	for (j = 0; j < n; j ++)
+		k[j] = 1;
+
+	while (more) {
+		more = 0;
+		for (j = 0; j < n; j ++) {
+			if (k[j] > r->nvns)
+				continue;
+			__builtin_prefetch (e + k[j] * RING_EYTZ_PREFETCH);
+			k[j] = 2 * k[j] + (e[k[j]] < hv[j]);
+			more = 1;
+		}
+	}
+
+	for (j = 0; j < n; j ++) {
+		k[j] >>= __builtin_ffs (~k[j]);
+		slot[j] = k[j] ? (int)r->eidx[k[j]] : r->nvns;
+	}
+}
+
+/** Interleaved prefix bucket searches, the bucket entries of all searches
+	are prefetched, then the first positions of all buckets. */
+static void _bucket_search_batch (const struct ring_t *r, const ring_key_t *hv, int n, int *slot)
+{
+	int j;
+
+	for (j = 0; j < n; j ++)
+		__builtin_prefetch (&r->bkt[hv[j] >> r->bkt_shift]);
+
+	for (j = 0; j < n; j ++)
+		__builtin_prefetch (&r->pos[r->bkt[hv[j] >> r->bkt_shift]]);
+
+	for (j = 0; j < n; j ++)
+		slot[j] = ring_bucket_search (r, hv[j]);
+}
+
+/** Find ring slots for $n hash values with interleaved searches, so that the
+	memory latency of one search overlaps the others. Slots wrap around as
+	ring_find_slot does. */
+void ring_find_slots (const struct ring_t *r, const ring_key_t *hv, int n, int *slot)
+{
+	int i, j, m;
+
+	for (i = 0; i < n; i += RING_BATCH) {
+		m = MIN (RING_BATCH, n - i);
+
+		if (r->bkt)
+			_bucket_search_batch (r, &hv[i], m, &slot[i]);
+		else
+			r->search_batch (r, &hv[i], m, &slot[i]);
+
+		for (j = i; j < i + m; j ++)
+			slot[j] = (slot[j] == r->nvns) ? 0 : slot[j];
+	}
+}
+
+/** Build the search layout of $r from its sorted positions and
+	select the kernel. Returns 0 on success. */
+int ring_layout_build (struct ring_t *r, int layout)
+{
+	int t = 0;
+
+	r->layout = layout;
+
+	switch (layout) {
+	case RING_LAYOUT_EYTZINGER:
+		r->eytz = (ring_key_t *) ring_alloc (sizeof (ring_key_t) * (r->nvns + 1));
+		r->eidx = (uint32_t *) ring_alloc (sizeof (uint32_t) * (r->nvns + 1));
+		if (unlikely (!r->eytz || !r->eidx))
+			return -1;
+		_eytz_fill (r, 1, &t);
+		r->search = _eytz_search;
+		r->search_batch = _eytz_search_batch;
+		break;
+
+	case RING_LAYOUT_FLAT:
+		r->search = _flat_search;
+		r->search_batch = _flat_search_batch;
+		break;
+
+	case RING_LAYOUT_STREE:
+	default:
+		r->layout = RING_LAYOUT_STREE;
+		r->nblocks = (r->nvns + RING_STREE_B - 1) / RING_STREE_B;
+		r->stree = (ring_key_t *) ring_alloc (sizeof (ring_key_t) * RING_STREE_B * (r->nblocks + 1));
+		r->sidx = (uint32_t *) ring_alloc (sizeof (uint32_t) * RING_STREE_B * (r->nblocks + 1));
+		if (unlikely (!r->stree || !r->sidx))
+			return -1;
+		_stree_fill (r, 0, &t);
+		r->search = ring_stree_search;
+		r->search_batch = ring_stree_search_batch;
+		break;
+	}
+
+	return 0;
+}
+
+/** Build the prefix bucket index of $r with 2^$bits buckets in one merge pass
+	over the sorted positions, O(2^bits + nvns). Returns 0 on success.
+	The ring snapshot itself is rebuilt in O(nvns) after each change, so the
+	table is rebuilt along with it instead of being patched bucket by bucket. */
+int ring_bucket_build (struct ring_t *r, int bits)
+{
+	int i = 0;
+	uint64_t b, nb;
+
+	if (bits <= 0)
+		return 0;
+
+	if (bits > RING_BUCKET_BITS_MAX)
+		bits = RING_BUCKET_BITS_MAX;
+
+	nb = 1ULL << bits;
+	r->bkt = (uint32_t *) ring_alloc (sizeof (uint32_t) * (nb + 1));
+	if (unlikely (!r->bkt))
+		return -1;
+
+	r->bkt_shift = RING_KEY_BITS - bits;
+
+	for (b = 0; b < nb; b ++) {
+		while (i < r->nvns && r->pos[i] < (ring_key_t)(b << r->bkt_shift))
+			i ++;
+		r->bkt[b] = i;
+	}
+	r->bkt[nb] = r->nvns;
+
+	return 0;
+}
+
+/** Select a S-tree search kernel for this CPU, once at startup. */
+__attribute__((constructor))
+static void ring_search_init (void)
+{
+	__builtin_cpu_init ();
+
+	if (__builtin_cpu_supports ("avx2")) {
+		ring_stree_search = _stree_search_avx2;
+		ring_stree_search_batch = _stree_search_batch_avx2;
+		ring_search_isa = "avx2";
+	}
+	else if (__builtin_cpu_supports ("sse4.2") &&
+			__builtin_cpu_supports ("popcnt")) {
+		ring_stree_search = _stree_search_sse42;
+		ring_stree_search_batch = _stree_search_batch_sse42;
+		ring_search_isa = "sse4.2";
+	}
+	else {
+		ring_stree_search = _flat_search;
+		ring_stree_search_batch = _flat_search_batch;
+		ring_search_isa = "scalar";
+	}
+}
+